@@ -7,156 +7,4381 @@
  * 
  */
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <set>
+#include <string>
 #include <vector>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <cpl_string.h>
 #include <ogrsf_frmts.h>
+#if GDAL_VERSION_MAJOR > 3 || (GDAL_VERSION_MAJOR == 3 && GDAL_VERSION_MINOR >= 4)
+#include <cpl_compressor.h>
+#endif
 
 #define MAXVERTICES 250
 #define OUTPUTDRIVER "ESRI Shapefile"
 #define OUTPUTTYPE wkbPolygon
 #define IDFIELD "id"
+#define CONVEXFIELD "convex"
+#define KINDFIELD "kind"
+#define MINXFIELD "minx"
+#define MINYFIELD "miny"
+#define MAXXFIELD "maxx"
+#define MAXYFIELD "maxy"
+#define AREAFIELD "area"
+#define VERTICESFIELD "vertices"
+#define HOLESFIELD "holes"
+#define DEPTHFIELD "depth"
+
+/* Options that only have a long form. getopt_long_only() lets these be
+ * written with a single dash, like -t_srs in ogr2ogr. */
+enum {
+    OPT_T_SRS = 256,
+    OPT_VERIFY,
+    OPT_MEMORY,
+    OPT_SPILL,
+    OPT_TILES,
+    OPT_MINZOOM,
+    OPT_MAXZOOM,
+    OPT_PRECISION,
+    OPT_COMPRESS,
+    OPT_ADJACENCY,
+    OPT_ATTRIBUTES,
+    OPT_ESTIMATE,
+    OPT_LONLAT
+};
 
 typedef std::vector<OGRPolygon *> OGRPolyList;
 typedef int feature_id_t;
 
-static bool debug = false;
+/* What split_polygons() has to get each piece down to. Any limit that's zero
+ * doesn't apply, except max_vertices, which always does. */
+typedef struct {
+    int max_vertices;   // points in the exterior ring, including the last
+    double max_area;    // of the bounding box
+    double max_side;    // width or height of the bounding box
+    double max_aspect;  // long side of the bounding box over the short one
+    double max_fill;    // area of the bounding box over the area of the piece
+    int max_holes;      // interior rings, or -1 for no limit
+    double max_seconds; // spent splitting each feature
+    long max_nodes;     // calls to split_polygons() for each feature
+} split_limits_t;
+
+/* How much more work split_polygons() may do on the current feature, and
+ * how it went. */
+typedef struct {
+    double deadline;    // as a wallclock() time, or 0 for no limit
+    long nodes;         // calls left, or -1 for no limit
+    bool exceeded;      // ran out of time or calls
+    const char *error;  // why part of the feature got lost, or NULL
+    std::vector<int> depths;    // of each piece, or -1 where it's not known
+    long clipped[2];            // nodes cut by each clipper
+    double clip_seconds[2];     // and the time spent cutting them
+} split_state_t;
+
+/* What an output polygon is, when approximations are written too. */
+typedef enum {
+    KIND_PIECE = 0,     // a piece of the feature
+    KIND_INNER = 1,     // lies entirely inside the feature
+    KIND_OUTER = 2      // entirely contains the feature
+} piece_kind_t;
+
+/* How each polygon gets broken up. */
+typedef enum {
+    SPLIT_QUADRANTS,    // split_polygons(): pieces of at most -m vertices
+    SPLIT_TRIANGLES,    // triangulate_polygons(): triangles
+    SPLIT_CONVEX,       // convex_polygons(): convex pieces of at most -m
+    SPLIT_TRAPEZOIDS,   // trapezoid_polygons(): horizontal trapezoids
+    SPLIT_COVERAGE      // split_coverage(): like quadrants, but layer-wide
+} split_mode_t;
+
+static bool debug = false;
+
+double wallclock(void) {
+    /* Seconds since the epoch, with microsecond resolution. */
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Which ways a polygon needs to be cut. */
+#define CUT_NONE 0
+#define CUT_X 1     // with a vertical line
+#define CUT_Y 2     // with a horizontal line
+
+/* Past this depth, pieces that are too big or too thin are left alone, in
+ * case they can't be made any smaller or fatter. */
+#define MAXDEPTH 40
+
+/* What split_polygons() cuts each polygon into quadrants with: GEOS, which
+ * copes with anything, or the rectangle clipper, which is much quicker, but
+ * needs valid rings that don't touch themselves or each other. */
+#define CLIP_NONE -1    // not cut yet, so not known to be valid
+#define CLIP_GEOS 0
+#define CLIP_RECT 1
+
+/* The rectangle clipper puts each hole in its piece by testing a point of it
+ * against every piece, so past this many holes times vertices, GEOS, which
+ * indexes them, is quicker. */
+#define RECTCLIPWORK 1000000
+
+int extent_cuts(const OGREnvelope &envelope, const split_limits_t &limits) {
+    /* Return which ways a polygon with this bounding box has to be cut
+     * before the box fits the limits. Too big a box calls for cuts both
+     * ways, whereas a box that's just too long or too thin gets cut across
+     * its length, which is the only thing that makes it less so. */
+    double width = envelope.MaxX - envelope.MinX,
+           height = envelope.MaxY - envelope.MinY;
+    if (limits.max_area > 0 && width * height > limits.max_area)
+        return CUT_X | CUT_Y;
+
+    int cuts = CUT_NONE;
+    if (limits.max_side > 0) {
+        if (width > limits.max_side) cuts |= CUT_X;
+        if (height > limits.max_side) cuts |= CUT_Y;
+    }
+    if (limits.max_aspect > 0 && width > 0 && height > 0) {
+        if (width > limits.max_aspect * height) cuts |= CUT_X;
+        if (height > limits.max_aspect * width) cuts |= CUT_Y;
+    }
+    return cuts;
+}
+
+int needed_cuts(OGRPolygon *polygon, const OGREnvelope &envelope,
+                const split_limits_t &limits, int depth) {
+    /* Return which ways the polygon has to be cut before it fits the
+     * limits. Too many vertices, or too much empty space in the bounding
+     * box, call for cuts both ways. */
+    if (polygon->getExteriorRing()->getNumPoints() > limits.max_vertices)
+        return CUT_X | CUT_Y;
+    if (depth >= MAXDEPTH)
+        return CUT_NONE;
+    if (limits.max_holes >= 0 && polygon->getNumInteriorRings() > limits.max_holes)
+        return CUT_X | CUT_Y;
+
+    double box_area = (envelope.MaxX - envelope.MinX) * (envelope.MaxY - envelope.MinY);
+    if (limits.max_fill > 0 && box_area > limits.max_fill * polygon->get_Area())
+        return CUT_X | CUT_Y;
+    return extent_cuts(envelope, limits);
+}
+
+bool hole_point(OGRGeometry *geometry, OGRPoint *point) {
+    /* If the geometry is a polygon with holes, set point to somewhere inside
+     * the biggest hole and return true. Cutting through there opens that
+     * hole up into notches in the pieces on either side of the cut. */
+    if (geometry == NULL || geometry->getGeometryType() != wkbPolygon)
+        return false;
+    OGRPolygon *polygon = (OGRPolygon*) geometry;
+    OGRLinearRing *biggest = NULL;
+    for (int i = 0; i < polygon->getNumInteriorRings(); i++) {
+        OGRLinearRing *hole = polygon->getInteriorRing(i);
+        if (biggest == NULL || hole->get_Area() > biggest->get_Area())
+            biggest = hole;
+    }
+    if (biggest == NULL) return false;
+    OGRPolygon inside;
+    inside.addRing(biggest);
+    return inside.PointOnSurface(point) == OGRERR_NONE;
+}
+
+/* Defined with the rectangle clipper, further down. */
+bool rings_touch(const OGRPolygon *polygon);
+OGRGeometry *clip_polygon(const OGRPolygon *polygon, const OGREnvelope &rect);
+
+void split_polygons(OGRPolyList *pieces, OGRGeometry* geometry,
+                    const split_limits_t &limits, int depth, int made_by,
+                    split_state_t *state) {
+    /* split_polygons recursively splits the (multi)polygon into smaller
+     * polygons until each polygon has at most limits.max_vertices, and fits
+     * any extent limits, and pushes each one onto the pieces vector.
+     * 
+     * Multipolygons are automatically divided into their constituent polygons.
+     * Empty polygons and other geometry types are ignored. Invalid polygons
+     * get cleaned up to the best of our ability, but this does trigger
+     * warnings from inside GEOS.
+     *
+     * Each polygon is split by dividing its bounding box into quadrants, and
+     * then recursing on the intersection of each quadrant with the original
+     * polygon, until the pieces are of the desired complexity. Pieces that
+     * are only too long or too thin are cut in two across their length
+     * instead. If there's a limit on holes, the cuts go through the biggest
+     * hole rather than the centroid, so that every cut gets rid of one.
+     *
+     * If there's a budget in the state, it's checked once per call, and as
+     * soon as it runs out, the whole thing gives up without splitting any
+     * further. If GEOS fails on a piece, the piece is left out, and the
+     * state's error is set. The state also gets the depth each piece was
+     * made at, which is how many cuts it took.
+     *
+     * Each polygon is cut with whichever clipper suits it: the rectangle
+     * clipper if it's known to be valid, its rings don't touch, and it
+     * doesn't have too many holes for its size, and GEOS otherwise. made_by
+     * says which clipper made the polygon, or CLIP_NONE for the top one.
+     * Only the top polygon, and those whose rings touch, have to be checked
+     * for validity, since what either clipper makes of a valid polygon is
+     * valid too, apart from the rectangle clipper's rings touching. So
+     * whether the rings touch is only worked out, which means sorting every
+     * vertex, where it could change anything: where the polygon is small
+     * enough for the rectangle clipper, or where that clipper made it. The
+     * state counts how many polygons each clipper cut, and how long it took.
+     */
+
+    if (state != NULL) {
+        if (state->exceeded)
+            return;
+        if ((state->nodes >= 0 && state->nodes-- == 0)
+                || (state->deadline > 0 && wallclock() > state->deadline)) {
+            state->exceeded = true;
+            return;
+        }
+    }
+
+    if (geometry == NULL) {
+        std::cerr << "WARNING: NULL geometry passed to split_polygons!\n";
+        return;
+    }
+    
+    if (geometry->IsEmpty())
+        return;
+    
+    if (geometry->getGeometryType() == wkbMultiPolygon) {
+        OGRMultiPolygon *multi = (OGRMultiPolygon*) geometry;
+        for (int i = 0; i < multi->getNumGeometries(); i++) {
+            split_polygons(pieces, multi->getGeometryRef(i), limits, depth, made_by,
+                           state);
+        }
+        return;
+    } 
+    
+    if (geometry->getGeometryType() != wkbPolygon)
+        return;
+    
+    OGRPolygon* polygon = (OGRPolygon*) geometry;
+    OGREnvelope envelope;
+    polygon->getEnvelope(&envelope);
+    int cuts = needed_cuts(polygon, envelope, limits, depth);
+    if (cuts == CUT_NONE) {
+        pieces->push_back((OGRPolygon*) polygon->clone());
+        if (state != NULL) state->depths.push_back(depth);
+        return;
+    }
+
+    double holes = polygon->getNumInteriorRings(),
+           vertices = polygon->getExteriorRing()->getNumPoints();
+    bool small = (holes * vertices <= RECTCLIPWORK),
+         touching = (small || made_by == CLIP_RECT) && rings_touch(polygon),
+         valid = (made_by != CLIP_NONE && !touching);
+
+    bool polygonIsPwned = false;
+    if (!valid && (!polygon->IsValid() || !polygon->IsSimple())) {
+        polygon = (OGRPolygon*) polygon->Buffer(0); // try to tidy it up
+        polygonIsPwned = true; // now we own the reference and have to free it later
+        if (polygon == NULL) {
+            if (state != NULL) state->error = "GEOS couldn't tidy up an invalid polygon";
+            return;
+        }
+    }
+    int clipper = (!touching && !polygonIsPwned && small ? CLIP_RECT : CLIP_GEOS);
+    if (state != NULL) state->clipped[clipper]++;
+
+    OGRPoint centroid;
+    if (limits.max_holes < 0 || !hole_point(polygon, &centroid))
+        polygon->Centroid(&centroid);
+    double cornerX = centroid.getX(),
+           cornerY = centroid.getY();
+
+    polygon->getEnvelope(&envelope);
+
+    for (int quadrant = 0; quadrant < 4; quadrant++) {
+        /* Bit 2 of the quadrant picks the right half, and bit 1 the top. */
+        if ((quadrant & 2) && !(cuts & CUT_X)) continue;
+        if ((quadrant & 1) && !(cuts & CUT_Y)) continue;
+        OGREnvelope bbox(envelope);
+        OGRLinearRing ring;
+        OGRPolygon mask;
+        if (cuts & CUT_X) {
+            if (quadrant & 2) bbox.MinX = cornerX; else bbox.MaxX = cornerX;
+        }
+        if (cuts & CUT_Y) {
+            if (quadrant & 1) bbox.MinY = cornerY; else bbox.MaxY = cornerY;
+        }
+        double clip_started = wallclock();
+        OGRGeometry* piece;
+        if (clipper == CLIP_RECT) {
+            piece = clip_polygon(polygon, bbox);
+        } else {
+            ring.setNumPoints(5);
+            ring.setPoint(0, bbox.MinX, bbox.MinY);
+            ring.setPoint(1, bbox.MinX, bbox.MaxY);
+            ring.setPoint(2, bbox.MaxX, bbox.MaxY);
+            ring.setPoint(3, bbox.MaxX, bbox.MinY);
+            ring.setPoint(4, bbox.MinX, bbox.MinY); // close the ring
+            mask.addRing(&ring);
+            piece = mask.Intersection(polygon);
+        }
+        if (state != NULL) state->clip_seconds[clipper] += wallclock() - clip_started;
+        if (piece == NULL) {
+            if (state != NULL)
+                state->error = (clipper == CLIP_RECT
+                                ? "the rectangle clipper couldn't clip a quadrant"
+                                : "GEOS couldn't intersect a quadrant");
+            continue;
+        }
+        split_polygons(pieces, piece, limits, depth + 1, clipper, state);
+        delete piece;
+    } 
+
+    if (polygonIsPwned) delete polygon;
+}
+
+/* Defined with the rectangle clipper, further down. */
+void split_within_budget(OGRPolyList *pieces, OGRGeometry *geometry,
+                         const split_limits_t &limits, split_state_t *state);
+
+void merge_pieces(OGRPolyList *pieces, std::vector<int> *depths,
+                  const split_limits_t &limits) {
+    /* merge_pieces greedily merges pieces of the same feature back
+     * together, wherever two of them share an edge and their union still
+     * fits the limits. Quadrant splitting tends to leave lots of tiny pieces
+     * with a handful of vertices next to each other, which cost an index
+     * entry apiece and save nothing at query time. Pieces whose bounding
+     * boxes don't touch, or whose combined bounding box wouldn't fit the
+     * limits, are never passed to GEOS. If the pieces' depths are given,
+     * they're kept in step, and a merged piece is as deep as the shallower
+     * of the two. */
+    OGRPolyList &list = *pieces;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i] == NULL) continue;
+        OGREnvelope envelope;
+        list[i]->getEnvelope(&envelope);
+
+        for (size_t j = i + 1; j < list.size(); j++) {
+            if (list[j] == NULL) continue;
+            OGREnvelope other, both(envelope);
+            list[j]->getEnvelope(&other);
+            if (!envelope.Intersects(other)) continue;
+            both.Merge(other);
+            if (extent_cuts(both, limits) != CUT_NONE) continue;
+
+            OGRGeometry *merged = list[i]->Union(list[j]);
+            if (merged == NULL || merged->getGeometryType() != wkbPolygon
+                    || needed_cuts((OGRPolygon*) merged, both, limits, 0) != CUT_NONE) {
+                delete merged; // not adjacent, or too big together
+                continue;
+            }
+            delete list[i];
+            delete list[j];
+            list[i] = (OGRPolygon*) merged;
+            list[j] = NULL;
+            if (depths != NULL)
+                (*depths)[i] = std::min((*depths)[i], (*depths)[j]);
+            envelope = both;
+            j = i; // it's bigger now, so try everything again
+        }
+    }
+    if (depths != NULL) {
+        size_t kept = 0;
+        for (size_t i = 0; i < list.size(); i++)
+            if (list[i] != NULL) (*depths)[kept++] = (*depths)[i];
+        depths->resize(kept);
+    }
+    list.erase(std::remove(list.begin(), list.end(), (OGRPolygon*) NULL), list.end());
+}
+
+OGRPolygon *envelope_polygon(double min_x, double min_y, double max_x, double max_y) {
+    /* Make a new rectangular polygon. */
+    OGRLinearRing ring;
+    ring.setNumPoints(5);
+    ring.setPoint(0, min_x, min_y);
+    ring.setPoint(1, min_x, max_y);
+    ring.setPoint(2, max_x, max_y);
+    ring.setPoint(3, max_x, min_y);
+    ring.setPoint(4, min_x, min_y);
+    OGRPolygon *polygon = new OGRPolygon;
+    polygon->addRing(&ring);
+    return polygon;
+}
+
+static void shift_polygon(OGRPolygon *polygon, double dx) {
+    for (int i = -1; i < polygon->getNumInteriorRings(); i++) {
+        OGRLinearRing *ring = (i < 0 ? polygon->getExteriorRing()
+                                     : polygon->getInteriorRing(i));
+        for (int k = 0; k < ring->getNumPoints(); k++)
+            ring->setPoint(k, ring->getX(k) + dx, ring->getY(k));
+    }
+}
+
+/* How close to +180 or -180 both ends of an edge have to be, in degrees, for
+ * a jump between them to count as crossing the antimeridian. */
+#define ANTIMERIDIANBAND 30
+
+/* How much of a polygon's area cutting it at the antimeridian may seem to
+ * gain or lose, relative to its area, before it counts as gone wrong. */
+#define ANTIMERIDIANTOLERANCE 1e-9
+
+static int unwrap_ring(OGRLinearRing *ring) {
+    /* Wherever the ring jumps between longitudes near +180 and near -180
+     * from one vertex to the next, assume it crossed the antimeridian
+     * instead, and shift everything after that point by a whole turn to
+     * make the ring continuous. Jumps between longitudes further in, and
+     * edges that run the whole way from -180 to +180, as a band around the
+     * world does, are taken as they are. Returns the number of crossings. */
+    double offset = 0, previous = ring->getX(0);
+    int crossings = 0;
+    for (int k = 1; k < ring->getNumPoints(); k++) {
+        double x = ring->getX(k), step = x - previous;
+        if (fabs(step) > 180 && fabs(step) < 360
+                && fabs(x) >= 180 - ANTIMERIDIANBAND
+                && fabs(previous) >= 180 - ANTIMERIDIANBAND) {
+            offset += (step > 0 ? -360 : 360);
+            crossings++;
+        }
+        previous = x;
+        ring->setPoint(k, x + offset, ring->getY(k));
+    }
+    return crossings;
+}
+
+/* Defined with the feature jobs, further down. */
+double geometry_area(const OGRGeometry *geometry);
+
+OGRGeometry *cut_antimeridian(OGRGeometry *geometry, const char **error) {
+    /* cut_antimeridian looks for component polygons of a geographic
+     * (multi)polygon that cross the antimeridian, i.e. whose rings jump
+     * between longitudes near +180 and -180. Left alone, these get split into
+     * pieces whose bounding boxes span the whole world, and every lookup
+     * anywhere would have to check them. Returns a new multipolygon in which
+     * each such component is cut in two along the antimeridian, or NULL if
+     * there aren't any.
+     *
+     * Rings that cross an odd number of times go around a pole, and can't be
+     * cut this way, so they're left as they are, as are those that come out
+     * of unwrapping with no area, which can't really have crossed. If GEOS
+     * can't cut one, or the halves don't add up to it, error is set and it
+     * returns NULL, rather than lose part of it. */
+    if (geometry == NULL || geometry->IsEmpty())
+        return NULL;
+
+    OGRMultiPolygon *multi = NULL;
+    if (geometry->getGeometryType() == wkbMultiPolygon)
+        multi = (OGRMultiPolygon*) geometry->clone();
+    else if (geometry->getGeometryType() == wkbPolygon) {
+        multi = new OGRMultiPolygon;
+        multi->addGeometry(geometry);
+    } else
+        return NULL;
+
+    OGRMultiPolygon *result = new OGRMultiPolygon;
+    bool cut = false;
+    for (int i = 0; i < multi->getNumGeometries(); i++) {
+        OGRPolygon *polygon = (OGRPolygon*) multi->getGeometryRef(i);
+        double area = polygon->getExteriorRing()->get_Area();
+        int crossings = unwrap_ring(polygon->getExteriorRing());
+        if (crossings == 0 || crossings % 2 != 0
+                || polygon->getExteriorRing()->get_Area() <= ANTIMERIDIANTOLERANCE * area) {
+            /* Keep the original, not the unwrapped one. */
+            result->addGeometry(geometry->getGeometryType() == wkbPolygon ? geometry
+                                : ((OGRMultiPolygon*) geometry)->getGeometryRef(i));
+            continue;
+        }
+
+        /* Unwrap the holes, and move each one by whole turns to wherever
+         * it's inside the unwrapped exterior. */
+        OGREnvelope outer;
+        polygon->getExteriorRing()->getEnvelope(&outer);
+        for (int h = 0; h < polygon->getNumInteriorRings(); h++) {
+            OGRLinearRing *hole = polygon->getInteriorRing(h);
+            OGREnvelope inner;
+            unwrap_ring(hole);
+            hole->getEnvelope(&inner);
+            double dx = 0, middle = (inner.MinX + inner.MaxX) / 2;
+            while (middle + dx < outer.MinX) dx += 360;
+            while (middle + dx > outer.MaxX) dx -= 360;
+            for (int k = 0; dx != 0 && k < hole->getNumPoints(); k++)
+                hole->setPoint(k, hole->getX(k) + dx, hole->getY(k));
+        }
+
+        /* Clip what's now east of +180 or west of -180, and move it back. */
+        double unwrapped = polygon->get_Area(), halves = 0;
+        for (int turn = -1; turn <= 1; turn++) {
+            OGRPolygon *band = envelope_polygon(turn * 360 - 180, outer.MinY,
+                                                turn * 360 + 180, outer.MaxY);
+            OGRGeometry *part = band->Intersection(polygon);
+            delete band;
+            if (part == NULL) {
+                *error = "GEOS couldn't cut it at the antimeridian";
+                delete multi;
+                delete result;
+                return NULL;
+            }
+            halves += geometry_area(part);
+            if (part->getGeometryType() == wkbPolygon) {
+                shift_polygon((OGRPolygon*) part, -turn * 360);
+                result->addGeometry(part);
+            } else if (part->getGeometryType() == wkbMultiPolygon) {
+                OGRMultiPolygon *parts = (OGRMultiPolygon*) part;
+                for (int k = 0; k < parts->getNumGeometries(); k++) {
+                    shift_polygon((OGRPolygon*) parts->getGeometryRef(k), -turn * 360);
+                    result->addGeometry(parts->getGeometryRef(k));
+                }
+            }
+            delete part;
+        }
+        if (fabs(halves - unwrapped) > ANTIMERIDIANTOLERANCE * unwrapped) {
+            *error = "cutting it at the antimeridian lost part of it";
+            delete multi;
+            delete result;
+            return NULL;
+        }
+        cut = true;
+    }
+    delete multi;
+
+    if (!cut) {
+        delete result;
+        return NULL;
+    }
+    return result;
+}
+
+/* Plain coordinate rings, for the geometry code that works on raw vertices
+ * rather than going through GEOS. Rings are not closed, i.e. the last point
+ * is not a repeat of the first. In a ring_list_t, the first ring is the
+ * exterior and any others are holes. */
+typedef struct { double x, y; } point_t;
+typedef std::vector<point_t> ring_t;
+typedef std::vector<ring_t> ring_list_t;
+typedef struct { int a, b, c; } triangle_t;
+
+inline bool same_point(const point_t &a, const point_t &b) {
+    return a.x == b.x && a.y == b.y;
+}
+
+inline double orient(const point_t &a, const point_t &b, const point_t &c) {
+    /* Twice the signed area of the triangle abc: positive if it turns
+     * counterclockwise, negative if clockwise, zero if collinear. */
+    return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+double signed_area(const ring_t &ring) {
+    double area = 0;
+    for (size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++)
+        area += ring[j].x * ring[i].y - ring[i].x * ring[j].y;
+    return area / 2;
+}
+
+void linear_ring_to_ring(const OGRLinearRing *linear, ring_t *ring) {
+    /* Copy an OGR ring, dropping the closing point and any repeated
+     * consecutive points. */
+    ring->clear();
+    for (int i = 0; i < linear->getNumPoints(); i++) {
+        point_t p = { linear->getX(i), linear->getY(i) };
+        if (ring->empty() || !same_point(ring->back(), p))
+            ring->push_back(p);
+    }
+    while (ring->size() > 1 && same_point(ring->front(), ring->back()))
+        ring->pop_back();
+}
+
+void polygon_to_rings(const OGRPolygon *polygon, ring_list_t *rings) {
+    /* Convert an OGR polygon to a ring list, with the exterior ring wound
+     * counterclockwise and the holes clockwise. Degenerate rings are
+     * dropped. */
+    rings->clear();
+    for (int i = -1; i < polygon->getNumInteriorRings(); i++) {
+        const OGRLinearRing *linear = (i < 0 ? polygon->getExteriorRing()
+                                             : polygon->getInteriorRing(i));
+        ring_t ring;
+        linear_ring_to_ring(linear, &ring);
+        if (ring.size() < 3) {
+            if (i < 0) return; // no exterior, no polygon
+            continue;
+        }
+        if ((signed_area(ring) < 0) == (i < 0))
+            std::reverse(ring.begin(), ring.end());
+        rings->push_back(ring);
+    }
+}
+
+void prune_chain(ring_t *chain, double tolerance) {
+    /* Drop every vertex of an open chain, apart from its two ends, that lies
+     * within tolerance of the straight line between the vertices kept on
+     * either side of it. Each dropped vertex is checked against the final
+     * segment that replaces it, so the boundary never moves by more than the
+     * tolerance, however many vertices in a row get dropped. A tolerance of
+     * zero drops only exactly collinear vertices.
+     *
+     * Rather than check every dropped vertex again for each new candidate
+     * end, each one narrows a range of directions from the last kept vertex,
+     * the anchor, measured as angles from the first vertex that narrowed it:
+     * a segment from the anchor passes within tolerance of the vertex if it
+     * points within that vertex's range and reaches at least as far.
+     * Vertices within tolerance of the anchor don't narrow it at all. So each
+     * candidate end is checked against everything it would replace at once,
+     * and the kept vertices are moved down in place, which makes the whole
+     * thing linear. */
+    ring_t &q = *chain;
+    size_t n = q.size(), kept = 1;
+    if (n < 3) return;
+    point_t a = q[0], axis = { 0, 0 };
+    bool narrowed = false;
+    double lo = 0, hi = 0, reach = 0;
+    for (size_t next = 2; next < n; next++) {
+        /* Narrow the range by the vertex just passed. */
+        point_t u = { q[next - 1].x - a.x, q[next - 1].y - a.y };
+        double d = sqrt(u.x * u.x + u.y * u.y);
+        if (d > tolerance) {
+            if (!narrowed) axis = u;
+            double angle = atan2(axis.x * u.y - axis.y * u.x, axis.x * u.x + axis.y * u.y),
+                   spread = asin(tolerance / d);
+            lo = (narrowed ? std::max(lo, angle - spread) : angle - spread);
+            hi = (narrowed ? std::min(hi, angle + spread) : angle + spread);
+            reach = std::max(reach, d);
+            narrowed = true;
+        }
+
+        point_t v = { q[next].x - a.x, q[next].y - a.y };
+        double angle = atan2(axis.x * v.y - axis.y * v.x, axis.x * v.x + axis.y * v.y);
+        bool straight = !narrowed || (lo <= angle && angle <= hi
+                                      && sqrt(v.x * v.x + v.y * v.y) >= reach);
+        if (!straight) {
+            a = q[next - 1];
+            q[kept++] = a;
+            narrowed = false;
+            reach = 0;
+        }
+    }
+    q[kept++] = q[n - 1];
+    q.resize(kept);
+}
+
+void prune_ring(ring_t *ring, double tolerance) {
+    /* Prune a ring as prune_chain() does, taking it as a chain from its first
+     * vertex all the way round and back again. Rings that would end up with
+     * fewer than three vertices are left alone. */
+    if (ring->size() < 4) return;
+    ring_t chain(*ring);
+    chain.push_back(chain[0]);
+    prune_chain(&chain, tolerance);
+    chain.pop_back();
+    if (chain.size() >= 3) ring->swap(chain);
+}
+
+void set_linear_ring(OGRLinearRing *linear, const ring_t &ring) {
+    /* Replace the points of an OGR ring, closing it. */
+    linear->setNumPoints(ring.size() + 1);
+    for (size_t i = 0; i < ring.size(); i++)
+        linear->setPoint(i, ring[i].x, ring[i].y);
+    linear->setPoint(ring.size(), ring[0].x, ring[0].y);
+}
+
+void prune_vertices(OGRGeometry *geometry, double tolerance) {
+    /* prune_vertices removes repeated consecutive vertices from every ring
+     * of the (multi)polygon in place, and if the tolerance isn't negative,
+     * collinear ones too, as in prune_ring(). These don't change the shape,
+     * or not by more than the tolerance, but they still count against -m,
+     * and cause splits that aren't needed. Rings that would end up with
+     * fewer than three vertices are left alone. */
+    if (geometry == NULL || geometry->IsEmpty())
+        return;
+    if (geometry->getGeometryType() == wkbMultiPolygon) {
+        OGRMultiPolygon *multi = (OGRMultiPolygon*) geometry;
+        for (int i = 0; i < multi->getNumGeometries(); i++)
+            prune_vertices(multi->getGeometryRef(i), tolerance);
+        return;
+    }
+    if (geometry->getGeometryType() != wkbPolygon)
+        return;
+
+    OGRPolygon *polygon = (OGRPolygon*) geometry;
+    for (int i = -1; i < polygon->getNumInteriorRings(); i++) {
+        OGRLinearRing *linear = (i < 0 ? polygon->getExteriorRing()
+                                       : polygon->getInteriorRing(i));
+        ring_t ring;
+        linear_ring_to_ring(linear, &ring);
+        if (ring.size() < 3) continue;
+        if (tolerance >= 0) prune_ring(&ring, tolerance);
+        if ((int) ring.size() + 1 < linear->getNumPoints())
+            set_linear_ring(linear, ring);
+    }
+}
+
+OGRPolygon *ring_to_polygon(const ring_t &ring) {
+    /* Make a new single-ring OGR polygon, closing the ring. */
+    OGRLinearRing linear;
+    set_linear_ring(&linear, ring);
+    OGRPolygon *polygon = new OGRPolygon;
+    polygon->addRing(&linear);
+    return polygon;
+}
+
+OGRPolygon *rings_to_polygon(const ring_list_t &rings) {
+    /* Make a new OGR polygon from a ring list, closing the rings. */
+    OGRPolygon *polygon = new OGRPolygon;
+    for (size_t i = 0; i < rings.size(); i++) {
+        OGRLinearRing linear;
+        set_linear_ring(&linear, rings[i]);
+        polygon->addRing(&linear);
+    }
+    return polygon;
+}
+
+static bool in_triangle(const point_t &p, const point_t &a,
+                        const point_t &b, const point_t &c) {
+    /* Is p inside or on the boundary of the counterclockwise triangle abc? */
+    return orient(a, b, p) >= 0 && orient(b, c, p) >= 0 && orient(c, a, p) >= 0;
+}
+
+static bool in_cone(const point_t &prev, const point_t &p,
+                    const point_t &next, const point_t &q) {
+    /* Does q lie in the interior angle at vertex p of a counterclockwise
+     * ring, between the edges from prev and to next? */
+    if (orient(prev, p, next) >= 0)
+        return orient(prev, p, q) > 0 && orient(p, next, q) > 0;
+    return orient(prev, p, q) > 0 || orient(p, next, q) > 0;
+}
+
+static bool x_descending(const ring_t *a, const ring_t *b) {
+    double ax = a->front().x, bx = b->front().x;
+    for (size_t i = 1; i < a->size(); i++) if ((*a)[i].x > ax) ax = (*a)[i].x;
+    for (size_t i = 1; i < b->size(); i++) if ((*b)[i].x > bx) bx = (*b)[i].x;
+    return ax > bx;
+}
+
+bool bridge_holes(const ring_list_t &rings, ring_t *outer) {
+    /* Merge the holes of a polygon into its exterior ring, by cutting a
+     * zero-width channel from each hole to a vertex visible from it. The
+     * result is a single weakly simple ring that can be ear clipped. Holes are
+     * processed rightmost first, so each channel runs to the right of its
+     * hole without crossing any hole not yet merged. (See David Eberly,
+     * "Triangulation by Ear Clipping".) Returns false if a hole couldn't be
+     * bridged, because it isn't inside the exterior. */
+    *outer = rings[0];
+    std::vector<const ring_t *> holes;
+    for (size_t i = 1; i < rings.size(); i++)
+        holes.push_back(&rings[i]);
+    std::sort(holes.begin(), holes.end(), x_descending);
+
+    for (size_t h = 0; h < holes.size(); h++) {
+        const ring_t &hole = *holes[h];
+        size_t m = 0;
+        for (size_t i = 1; i < hole.size(); i++)
+            if (hole[i].x > hole[m].x) m = i;
+        point_t M = hole[m];
+
+        /* Cast a ray from M in the +x direction and find the nearest point of
+         * the outer ring that it hits. If that's a vertex, because the ray
+         * goes through one or along a horizontal edge, it's visible from M.
+         * Otherwise it's on an edge, and P is the end of the edge furthest
+         * to the right. */
+        size_t n = outer->size(), p = n;
+        double hit_x = 0;
+        bool hit_vertex = false;
+        for (size_t i = 0; i < n; i++) {
+            const point_t &a = (*outer)[i], &b = (*outer)[(i + 1) % n];
+            if (std::min(a.y, b.y) > M.y || std::max(a.y, b.y) < M.y) continue;
+            double x;
+            size_t vertex = n;
+            if (a.y == M.y && (b.y != M.y || a.x <= b.x)) {
+                x = a.x;
+                vertex = i;
+            } else if (b.y == M.y) {
+                x = b.x;
+                vertex = (i + 1) % n;
+            } else
+                x = a.x + (M.y - a.y) * (b.x - a.x) / (b.y - a.y);
+            if (x < M.x || (p < n && x > hit_x)
+                    || (p < n && x == hit_x && (hit_vertex || vertex == n)))
+                continue;
+            hit_x = x;
+            hit_vertex = (vertex < n);
+            p = (hit_vertex ? vertex : (a.x > b.x ? i : (i + 1) % n));
+        }
+        if (p == n) return false; // the hole isn't inside the exterior
+
+        /* The edge endpoint might be hidden from M by another part of the
+         * ring. If any reflex vertex lies in the triangle between M, the hit
+         * point and the endpoint, use the one closest in angle to the ray,
+         * and the nearest of those, which nothing else can hide. */
+        point_t I = { hit_x, M.y }, P = (*outer)[p];
+        if (!hit_vertex) {
+            point_t a = M, b = I, c = P;
+            if (orient(a, b, c) < 0) std::swap(b, c);
+            double best = -2, nearest = 0;
+            for (size_t i = 0; i < n; i++) {
+                const point_t &v = (*outer)[i];
+                if (same_point(v, P) || same_point(v, M)) continue;
+                if (orient((*outer)[(i + n - 1) % n], v, (*outer)[(i + 1) % n]) >= 0
+                        || !in_triangle(v, a, b, c))
+                    continue;
+                double dx = v.x - M.x, dy = v.y - M.y,
+                       distance = sqrt(dx * dx + dy * dy),
+                       cosine = dx / distance;
+                if (cosine > best || (cosine == best && distance < nearest)) {
+                    best = cosine;
+                    nearest = distance;
+                    p = i;
+                }
+            }
+            P = (*outer)[p];
+        }
+
+        /* Earlier channels can leave several copies of P in the ring. Pick
+         * the one whose interior angle faces M. */
+        for (size_t i = 0; i < n; i++) {
+            if (same_point((*outer)[i], P) && in_cone((*outer)[(i + n - 1) % n], P,
+                                                       (*outer)[(i + 1) % n], M)) {
+                p = i;
+                break;
+            }
+        }
+
+        ring_t merged(outer->begin(), outer->begin() + p + 1);
+        for (size_t i = 0; i <= hole.size(); i++)
+            merged.push_back(hole[(m + i) % hole.size()]);
+        merged.insert(merged.end(), outer->begin() + p, outer->end());
+        outer->swap(merged);
+    }
+    return true;
+}
+
+void ear_clip(const ring_t &ring, std::vector<triangle_t> *triangles) {
+    /* Triangulate a counterclockwise, weakly simple ring by repeatedly
+     * cutting off ears, and push the triangles onto the vector as indexes
+     * into the ring. This is O(n^2), so it's meant for rings of a few hundred
+     * vertices at most. Collinear vertices are cut off without making a
+     * triangle. */
+    int n = ring.size();
+    if (n < 3) return;
+    std::vector<int> prev(n), next(n);
+    for (int i = 0; i < n; i++) {
+        prev[i] = (i + n - 1) % n;
+        next[i] = (i + 1) % n;
+    }
+
+    int v = 0, remaining = n, misses = 0;
+    while (remaining > 3) {
+        int a = prev[v], c = next[v];
+        double turn = orient(ring[a], ring[v], ring[c]);
+        bool ear = (turn == 0);
+
+        if (turn > 0) {
+            /* It's an ear if no other reflex vertex is inside it. Vertices
+             * that coincide with a corner are copies made by bridge_holes()
+             * and don't count. */
+            ear = true;
+            for (int u = next[c]; u != a; u = next[u]) {
+                const point_t &p = ring[u];
+                if (same_point(p, ring[a]) || same_point(p, ring[v])
+                        || same_point(p, ring[c]))
+                    continue;
+                if (orient(ring[prev[u]], p, ring[next[u]]) <= 0
+                        && in_triangle(p, ring[a], ring[v], ring[c])) {
+                    ear = false;
+                    break;
+                }
+            }
+        }
+
+        /* If we've gone all the way around without finding an ear, the ring
+         * must not be simple. Cut off the next convex vertex anyway, so we
+         * always terminate. */
+        if (!ear && misses > remaining && turn > 0) ear = true;
+
+        if (ear) {
+            if (turn > 0) {
+                triangle_t t = { a, v, c };
+                triangles->push_back(t);
+            }
+            next[a] = c;
+            prev[c] = a;
+            remaining--;
+            misses = 0;
+            v = c;
+        } else {
+            if (++misses > 2 * remaining) break; // nothing convex left
+            v = c;
+        }
+    }
+    if (remaining == 3 && orient(ring[prev[v]], ring[v], ring[next[v]]) > 0) {
+        triangle_t t = { prev[v], v, next[v] };
+        triangles->push_back(t);
+    }
+}
+
+/* How far, relative to a polygon's area, the areas of its triangles or
+ * convex pieces can add up to something else before it counts as lost. */
+#define EARCLIPTOLERANCE 1e-9
+
+static bool pieces_fill(const ring_list_t &rings, const std::vector<ring_t> &pieces) {
+    /* Whether the pieces' areas add up to the area of the polygon. */
+    double area = 0, total = 0;
+    for (size_t i = 0; i < rings.size(); i++)
+        area += signed_area(rings[i]);
+    for (size_t i = 0; i < pieces.size(); i++)
+        total += fabs(signed_area(pieces[i]));
+    return fabs(total - area) <= EARCLIPTOLERANCE * fabs(area);
+}
+
+void split_for_ear_clip(OGRPolyList *parts, OGRGeometry *geometry,
+                        const split_limits_t &limits, split_state_t *state) {
+    /* split_within_budget() the geometry into parts small enough to ear
+     * clip. The vertex limit only counts the exterior ring, but the holes
+     * get bridged into it, so any part whose rings add up to more than the
+     * limit is split again, with the cuts going through its holes until
+     * they're all gone, out of the same budget. The state is as for
+     * split_within_budget(). */
+    split_within_budget(parts, geometry, limits, state);
+    split_limits_t holeless = limits;
+    holeless.max_holes = 0;
+    OGRPolyList fitted;
+    for (OGRPolyList::iterator it = parts->begin(); it != parts->end(); it++) {
+        int vertices = (*it)->getExteriorRing()->getNumPoints();
+        for (int i = 0; i < (*it)->getNumInteriorRings(); i++)
+            vertices += (*it)->getInteriorRing(i)->getNumPoints();
+        if (vertices <= limits.max_vertices) {
+            fitted.push_back(*it);
+            continue;
+        }
+        split_within_budget(&fitted, *it, holeless, state);
+        delete *it;
+    }
+    parts->swap(fitted);
+}
+
+void triangulate_polygons(OGRPolyList *pieces, OGRGeometry *geometry,
+                          const split_limits_t &limits, split_state_t *state) {
+    /* triangulate_polygons breaks the (multi)polygon into triangles, and
+     * pushes each one onto the pieces vector, so that a point lookup needs
+     * only three orientation tests once a piece is found.
+     *
+     * Ear clipping is quadratic in the ring size, so the geometry is first
+     * split_for_ear_clip() into pieces that fit the limits, holes and all,
+     * and then each piece's holes are bridged into its exterior and the
+     * result is ear clipped. A piece with a hole that can't be bridged, or
+     * whose triangles' areas don't add up to its own, is left out, and the
+     * state's error is set. The state is as for
+     * split_within_budget(). */
+    OGRPolyList parts;
+    split_for_ear_clip(&parts, geometry, limits, state);
+    for (OGRPolyList::iterator it = parts.begin(); it != parts.end(); it++) {
+        ring_list_t rings;
+        ring_t ring;
+        std::vector<triangle_t> triangles;
+
+        polygon_to_rings(*it, &rings);
+        delete *it;
+        if (rings.empty()) continue;
+        if (!bridge_holes(rings, &ring)) {
+            state->error = "a hole isn't inside the polygon";
+            continue;
+        }
+        ear_clip(ring, &triangles);
+        std::vector<ring_t> corners(triangles.size(), ring_t(3));
+        for (size_t i = 0; i < triangles.size(); i++) {
+            corners[i][0] = ring[triangles[i].a];
+            corners[i][1] = ring[triangles[i].b];
+            corners[i][2] = ring[triangles[i].c];
+        }
+        if (!pieces_fill(rings, corners)) {
+            state->error = "the triangles don't add up to the polygon";
+            continue;
+        }
+        for (size_t i = 0; i < corners.size(); i++)
+            pieces->push_back(ring_to_polygon(corners[i]));
+    }
+}
+
+void merge_convex(const ring_t &ring, const std::vector<triangle_t> &triangles,
+                  size_t max_vertices, std::vector<ring_t> *convex) {
+    /* Merge a triangulation of the ring back into convex pieces of at most
+     * max_vertices, by removing every diagonal whose two sides still make a
+     * convex polygon when joined (Hertel and Mehlhorn's algorithm). This makes
+     * at most four times as many pieces as an optimal convex decomposition.
+     * Triangles are given as indexes into the ring; the pieces are pushed
+     * onto the convex vector. */
+    typedef std::pair<int, int> edge_t;
+    std::vector< std::vector<int> > polys(triangles.size());
+    std::map<edge_t, int> owner; // directed edge -> polygon on its left
+
+    for (size_t i = 0; i < triangles.size(); i++) {
+        int corners[3] = { triangles[i].a, triangles[i].b, triangles[i].c };
+        polys[i].assign(corners, corners + 3);
+        for (int k = 0; k < 3; k++)
+            owner[edge_t(corners[k], corners[(k + 1) % 3])] = i;
+    }
+
+    for (size_t t = 0; t < triangles.size(); t++) {
+        int corners[3] = { triangles[t].a, triangles[t].b, triangles[t].c };
+        for (int k = 0; k < 3; k++) {
+            int u = corners[k], v = corners[(k + 1) % 3];
+            std::map<edge_t, int>::iterator left = owner.find(edge_t(u, v)),
+                                            right = owner.find(edge_t(v, u));
+            if (left == owner.end() || right == owner.end()) continue;
+            int p = left->second, q = right->second;
+            if (p == q) continue;
+            std::vector<int> &P = polys[p], &Q = polys[q];
+            if (P.size() + Q.size() - 2 > max_vertices) continue;
+
+            /* Join P (which runs u -> v) and Q (which runs v -> u) into one
+             * ring starting at v, and check that it stays convex at the two
+             * ends of the diagonal. */
+            size_t pv = std::find(P.begin(), P.end(), v) - P.begin(),
+                   qu = std::find(Q.begin(), Q.end(), u) - Q.begin();
+            std::vector<int> joined;
+            for (size_t i = 0; i < P.size() - 1; i++)
+                joined.push_back(P[(pv + i) % P.size()]);
+            for (size_t i = 0; i < Q.size() - 1; i++)
+                joined.push_back(Q[(qu + i) % Q.size()]);
+            size_t n = joined.size(), ju = P.size() - 1;
+            if (orient(ring[joined[ju - 1]], ring[joined[ju]], ring[joined[ju + 1]]) < 0
+                    || orient(ring[joined[n - 1]], ring[joined[0]], ring[joined[1]]) < 0)
+                continue;
+
+            owner.erase(edge_t(u, v));
+            owner.erase(edge_t(v, u));
+            for (size_t i = 0; i < Q.size(); i++) {
+                edge_t e(Q[i], Q[(i + 1) % Q.size()]);
+                if (owner.count(e)) owner[e] = p;
+            }
+            P.swap(joined);
+            Q.clear();
+        }
+    }
+
+    for (size_t i = 0; i < polys.size(); i++) {
+        if (polys[i].empty()) continue;
+        ring_t piece;
+        for (size_t k = 0; k < polys[i].size(); k++)
+            piece.push_back(ring[polys[i][k]]);
+        convex->push_back(piece);
+    }
+}
+
+void convex_polygons(OGRPolyList *pieces, OGRGeometry *geometry,
+                     const split_limits_t &limits, split_state_t *state) {
+    /* convex_polygons breaks the (multi)polygon into convex pieces that fit
+     * the limits, and pushes each one onto the pieces vector. Point lookups
+     * in a convex piece can binary search the triangle fan around its first
+     * vertex instead of testing every edge.
+     *
+     * Each piece from split_polygons() is triangulated as in
+     * triangulate_polygons(), and then the triangles are merged back
+     * together. As there, if a hole can't be bridged or the pieces' areas
+     * don't add up to the piece's, it's left out and the state's error is
+     * set. The state is as for
+     * split_within_budget(). */
+    OGRPolyList parts;
+    split_for_ear_clip(&parts, geometry, limits, state);
+    for (OGRPolyList::iterator it = parts.begin(); it != parts.end(); it++) {
+        ring_list_t rings;
+        ring_t ring;
+        std::vector<triangle_t> triangles;
+        std::vector<ring_t> convex;
+
+        polygon_to_rings(*it, &rings);
+        delete *it;
+        if (rings.empty()) continue;
+        if (!bridge_holes(rings, &ring)) {
+            state->error = "a hole isn't inside the polygon";
+            continue;
+        }
+        ear_clip(ring, &triangles);
+        merge_convex(ring, triangles, limits.max_vertices - 1, &convex);
+        if (!pieces_fill(rings, convex)) {
+            /* Merging can't hide triangles that overlap or leave gaps. */
+            state->error = "the convex pieces don't add up to the polygon";
+            continue;
+        }
+        for (size_t i = 0; i < convex.size(); i++)
+            pieces->push_back(ring_to_polygon(convex[i]));
+    }
+}
+
+/* A polygon edge, stored bottom to top, along with the index of the feature
+ * it belongs to when edges from several features are swept together. */
+typedef struct {
+    point_t lo, hi;
+    int owner;
+} segment_t;
+
+inline double x_at(const segment_t &s, double y) {
+    /* Where the (non-horizontal) segment crosses the horizontal line at y.
+     * The endpoints are returned exactly, so that neighbouring slabs agree. */
+    if (y == s.lo.y) return s.lo.x;
+    if (y == s.hi.y) return s.hi.x;
+    return s.lo.x + (y - s.lo.y) * (s.hi.x - s.lo.x) / (s.hi.y - s.lo.y);
+}
+
+void ring_segments(const ring_t &ring, int owner, std::vector<segment_t> *segments) {
+    /* Push the non-horizontal edges of the ring onto the vector. */
+    for (size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++) {
+        if (ring[i].y == ring[j].y) continue;
+        segment_t s;
+        s.lo = (ring[i].y < ring[j].y ? ring[i] : ring[j]);
+        s.hi = (ring[i].y < ring[j].y ? ring[j] : ring[i]);
+        s.owner = owner;
+        segments->push_back(s);
+    }
+}
+
+class SlabSweep {
+    /* Sweeps a horizontal line up through a set of segments, stopping at
+     * every distinct vertex y coordinate. Between two stops, none of the
+     * segments of a simple polygon (or of a polygon coverage) start, end or
+     * cross, so the segments crossing the slab have a fixed left to right
+     * order. After each call to next(), bottom and top are the y extent of
+     * the current slab, and active holds the indexes of the segments crossing
+     * it, sorted left to right. */
+public:
+    double bottom, top;
+    std::vector<int> active;
+
+    SlabSweep(const std::vector<segment_t> &segments)
+            : segments_(segments), next_start_(0), stop_(0) {
+        for (size_t i = 0; i < segments.size(); i++) {
+            order_.push_back(i);
+            stops_.push_back(segments[i].lo.y);
+            stops_.push_back(segments[i].hi.y);
+        }
+        std::sort(order_.begin(), order_.end(), LowerStart(segments));
+        std::sort(stops_.begin(), stops_.end());
+        stops_.erase(std::unique(stops_.begin(), stops_.end()), stops_.end());
+    }
+
+    bool next() {
+        if (stop_ + 1 >= stops_.size()) return false;
+        bottom = stops_[stop_];
+        top = stops_[++stop_];
+
+        size_t kept = 0;
+        for (size_t i = 0; i < active.size(); i++)
+            if (segments_[active[i]].hi.y > bottom)
+                active[kept++] = active[i];
+        active.resize(kept);
+        while (next_start_ < order_.size()
+                && segments_[order_[next_start_]].lo.y <= bottom)
+            active.push_back(order_[next_start_++]);
+        std::sort(active.begin(), active.end(),
+                  LeftOf(segments_, (bottom + top) / 2));
+        return true;
+    }
+
+private:
+    struct LowerStart {
+        const std::vector<segment_t> &s;
+        LowerStart(const std::vector<segment_t> &s) : s(s) {}
+        bool operator()(int a, int b) const { return s[a].lo.y < s[b].lo.y; }
+    };
+    struct LeftOf {
+        const std::vector<segment_t> &s;
+        double y;
+        LeftOf(const std::vector<segment_t> &s, double y) : s(s), y(y) {}
+        bool operator()(int a, int b) const { return x_at(s[a], y) < x_at(s[b], y); }
+    };
+
+    const std::vector<segment_t> &segments_;
+    std::vector<int> order_;
+    std::vector<double> stops_;
+    size_t next_start_, stop_;
+};
+
+static void push_trapezoid(const segment_t &left, const segment_t &right,
+                           double bottom, double top, std::vector<ring_t> *out) {
+    /* Push the trapezoid between two segments and two horizontal lines,
+     * counterclockwise from the bottom left, collapsing it to a triangle if
+     * the segments meet at the top or bottom. */
+    point_t corners[4] = {
+        { x_at(left, bottom), bottom }, { x_at(right, bottom), bottom },
+        { x_at(right, top), top },      { x_at(left, top), top } };
+    ring_t trapezoid;
+    for (int k = 0; k < 4; k++)
+        if (trapezoid.empty() || !same_point(trapezoid.back(), corners[k]))
+            trapezoid.push_back(corners[k]);
+    if (same_point(trapezoid.front(), trapezoid.back())) trapezoid.pop_back();
+    if (trapezoid.size() >= 3 && signed_area(trapezoid) > 0)
+        out->push_back(trapezoid);
+}
+
+void trapezoid_rings(const ring_list_t &rings, std::vector<ring_t> *trapezoids) {
+    /* Decompose the polygon into trapezoids with horizontal tops and bottoms,
+     * pushing each one onto the vector. Within every slab of the sweep, the
+     * inside of the polygon lies between the first and second segments, the
+     * third and fourth, and so on. A trapezoid is carried on up through the
+     * following slabs for as long as it is bounded by the same two segments,
+     * which keeps the number of trapezoids linear in the number of
+     * vertices. */
+    typedef std::pair<int, int> sides_t;
+    typedef std::map<sides_t, double> open_t; // bounding segments -> bottom
+    std::vector<segment_t> segments;
+    for (size_t i = 0; i < rings.size(); i++)
+        ring_segments(rings[i], 0, &segments);
+
+    SlabSweep sweep(segments);
+    open_t open;
+    double top = 0;
+    while (sweep.next()) {
+        open_t still_open;
+        for (size_t i = 0; i + 1 < sweep.active.size(); i += 2) {
+            sides_t sides(sweep.active[i], sweep.active[i + 1]);
+            open_t::iterator it = open.find(sides);
+            still_open[sides] = (it == open.end() ? sweep.bottom : it->second);
+            if (it != open.end()) open.erase(it);
+        }
+        /* Whatever didn't carry on ended at the bottom of this slab. */
+        for (open_t::iterator it = open.begin(); it != open.end(); it++)
+            push_trapezoid(segments[it->first.first], segments[it->first.second],
+                           it->second, sweep.bottom, trapezoids);
+        open.swap(still_open);
+        top = sweep.top;
+    }
+    for (open_t::iterator it = open.begin(); it != open.end(); it++)
+        push_trapezoid(segments[it->first.first], segments[it->first.second],
+                       it->second, top, trapezoids);
+}
+
+void trapezoid_polygons(OGRPolyList *pieces, OGRGeometry *geometry, split_state_t *state) {
+    /* trapezoid_polygons breaks the (multi)polygon into trapezoids with
+     * horizontal tops and bottoms (some of which are triangles), and pushes
+     * each one onto the pieces vector. A point is inside one of these if it's
+     * between the top and bottom and on the right side of two edges, and the
+     * pieces line up with the horizontal slabs of a slab-indexed lookup. If
+     * a polygon can't be tidied up, it's left out and the state's error is
+     * set. */
+    if (geometry == NULL || geometry->IsEmpty())
+        return;
+
+    if (geometry->getGeometryType() == wkbMultiPolygon) {
+        OGRMultiPolygon *multi = (OGRMultiPolygon*) geometry;
+        for (int i = 0; i < multi->getNumGeometries(); i++)
+            trapezoid_polygons(pieces, multi->getGeometryRef(i), state);
+        return;
+    }
+    if (geometry->getGeometryType() != wkbPolygon)
+        return;
+
+    /* The sweep needs edges that don't cross, so tidy up invalid input the
+     * same way split_polygons() does. */
+    if (!geometry->IsValid()) {
+        OGRGeometry *tidy = geometry->Buffer(0);
+        if (tidy != NULL && tidy->IsValid())
+            trapezoid_polygons(pieces, tidy, state);
+        else
+            state->error = "GEOS couldn't tidy up an invalid polygon";
+        delete tidy;
+        return;
+    }
+
+    ring_list_t rings;
+    std::vector<ring_t> trapezoids;
+    polygon_to_rings((OGRPolygon*) geometry, &rings);
+    if (rings.empty()) return;
+    trapezoid_rings(rings, &trapezoids);
+    for (size_t i = 0; i < trapezoids.size(); i++)
+        pieces->push_back(ring_to_polygon(trapezoids[i]));
+}
+
+/* Clipping polygons to rectangles, without GEOS. This is faster than a
+ * general overlay, and it's deterministic: the point where an edge crosses
+ * the rectangle is always computed from the edge's endpoints in the same
+ * order, so two polygons that share an edge get bit-identical vertices where
+ * it's cut, whichever direction they run along it. */
+
+static inline bool in_rect(const point_t &p, const OGREnvelope &r) {
+    return p.x >= r.MinX && p.x <= r.MaxX && p.y >= r.MinY && p.y <= r.MaxY;
+}
+
+static point_t on_side(const point_t &p, const point_t &q, int side, const OGREnvelope &r) {
+    /* Where the line through p and q crosses one side of the rectangle:
+     * 0 for the left, 1 right, 2 bottom, 3 top. */
+    point_t c;
+    if (side < 2) {
+        c.x = (side == 0 ? r.MinX : r.MaxX);
+        c.y = p.y + (c.x - p.x) * (q.y - p.y) / (q.x - p.x);
+        c.y = std::min(std::max(c.y, r.MinY), r.MaxY);
+    } else {
+        c.y = (side == 2 ? r.MinY : r.MaxY);
+        c.x = p.x + (c.y - p.y) * (q.x - p.x) / (q.y - p.y);
+        c.x = std::min(std::max(c.x, r.MinX), r.MaxX);
+    }
+    return c;
+}
+
+bool clip_segment(const point_t &a, const point_t &b, const OGREnvelope &r,
+                  point_t *ca, point_t *cb) {
+    /* Clip the segment ab to the rectangle (boundary included), Liang-Barsky
+     * style. Returns false if it misses the rectangle; otherwise sets ca and
+     * cb to the ends of the part inside, in the same direction as ab. */
+    bool swapped = (b.x < a.x || (b.x == a.x && b.y < a.y));
+    const point_t &p = (swapped ? b : a), &q = (swapped ? a : b);
+    double dx = q.x - p.x, dy = q.y - p.y,
+           pk[4] = { -dx, dx, -dy, dy },
+           qk[4] = { p.x - r.MinX, r.MaxX - p.x, p.y - r.MinY, r.MaxY - p.y },
+           t0 = 0, t1 = 1;
+    int side0 = -1, side1 = -1;
+
+    for (int k = 0; k < 4; k++) {
+        if (pk[k] == 0) {
+            if (qk[k] < 0) return false;
+            continue;
+        }
+        double t = qk[k] / pk[k];
+        if (pk[k] < 0) {
+            if (t > t1) return false;
+            if (t > t0) { t0 = t; side0 = k; }
+        } else {
+            if (t < t0) return false;
+            if (t < t1) { t1 = t; side1 = k; }
+        }
+    }
+    point_t p0 = (side0 < 0 ? p : on_side(p, q, side0, r)),
+            p1 = (side1 < 0 ? q : on_side(p, q, side1, r));
+    *ca = (swapped ? p1 : p0);
+    *cb = (swapped ? p0 : p1);
+    return true;
+}
+
+static double perimeter_position(const point_t &p, const OGREnvelope &r) {
+    /* How far along the boundary of the rectangle the point is,
+     * counterclockwise from the bottom left corner. */
+    double w = r.MaxX - r.MinX, h = r.MaxY - r.MinY;
+    if (p.y == r.MinY) return p.x - r.MinX;
+    if (p.x == r.MaxX) return w + (p.y - r.MinY);
+    if (p.y == r.MaxY) return w + h + (r.MaxX - p.x);
+    if (p.x == r.MinX) return 2 * w + h + (r.MaxY - p.y);
+
+    /* Not quite on the boundary; use the nearest side. */
+    double d[4] = { p.y - r.MinY, r.MaxX - p.x, r.MaxY - p.y, p.x - r.MinX };
+    int k = std::min_element(d, d + 4) - d;
+    point_t q = p;
+    if (k == 0) q.y = r.MinY; else if (k == 1) q.x = r.MaxX;
+    else if (k == 2) q.y = r.MaxY; else q.x = r.MinX;
+    return perimeter_position(q, r);
+}
+
+class RectClipper {
+    /* Clips one polygon to a rectangle. The rings are fed in a point at a
+     * time, which means they can be streamed from somewhere else rather
+     * than held in memory: begin_ring(), add_point() for each vertex (not
+     * repeating the first), end_ring(), and finally finish(). The exterior
+     * ring has to be counterclockwise and the holes clockwise, so that the
+     * inside of the polygon is always on the left.
+     *
+     * Each ring is broken into chains, the stretches of it inside the
+     * rectangle, each starting and ending on the rectangle's boundary. The
+     * pieces of the result are made by following a chain to its end, then
+     * going counterclockwise around the boundary to the start of the next
+     * chain, and so on until getting back to the first. Rings that never
+     * touch the rectangle only matter in case the rectangle is inside them,
+     * and rings that are entirely inside it are kept as they are.
+     *
+     * A ring that isn't entirely inside the rectangle can also be fed in as
+     * just those of its edges that touch it, in order: begin_ring(),
+     * add_ring_edge() for each, then end_partial_ring(). The edges that are
+     * left out can't say whether the rectangle is inside the polygon, so
+     * the caller has to work that out, and pass it to set_inside(). */
+public:
+    RectClipper(const OGREnvelope &rect) : rect_(rect), outside_parity_(false) {
+        centre_.x = (rect.MinX + rect.MaxX) / 2;
+        centre_.y = (rect.MinY + rect.MaxY) / 2;
+    }
+
+    void begin_ring() {
+        first_point_ = true;
+        all_inside_ = true;
+        open_ = false;
+        head_open_ = false;
+        parity_ = false;
+        chain_.clear();
+        head_.clear();
+        whole_.clear();
+        ring_chains_ = chains_.size();
+    }
+
+    void add_point(const point_t &p) {
+        if (first_point_) {
+            first_point_ = false;
+            first_ = prev_ = p;
+            if (in_rect(p, rect_)) {
+                open_ = head_open_ = true;
+                chain_.push_back(p);
+            }
+            all_inside_ = open_;
+            if (all_inside_) whole_.push_back(p);
+            return;
+        }
+        add_edge(prev_, p);
+        if (all_inside_) whole_.push_back(p);
+        prev_ = p;
+    }
+
+    void end_ring() {
+        if (first_point_) return;
+        add_edge(prev_, first_);
+        if (all_inside_) {
+            if (whole_.size() >= 3) whole_rings_.push_back(whole_);
+            return;
+        }
+        close_chain();
+        /* A ring that only touches the boundary doesn't cut anything off,
+         * but the rectangle might be inside it. */
+        if (chains_.size() == ring_chains_ && parity_)
+            outside_parity_ = !outside_parity_;
+    }
+
+    void add_ring_edge(const point_t &a, const point_t &b) {
+        if (first_point_) add_point(a);
+        add_edge(a, b);
+        all_inside_ = false;
+        prev_ = b;
+    }
+
+    void end_partial_ring() {
+        if (!first_point_) close_chain();
+    }
+
+    void set_inside(bool inside) {
+        /* Say whether the centre of the rectangle is inside the polygon,
+         * apart from rings entirely inside the rectangle. */
+        outside_parity_ = inside;
+    }
+
+    void finish(std::vector<ring_list_t> *out) {
+        /* Assemble the clipped polygons and push them onto out. */
+        std::vector<ring_t> exteriors, holes;
+        for (size_t i = 0; i < whole_rings_.size(); i++)
+            (signed_area(whole_rings_[i]) > 0 ? exteriors : holes).push_back(whole_rings_[i]);
+
+        if (!chains_.empty())
+            follow_chains(&exteriors);
+        else if (outside_parity_) {
+            /* The rectangle is inside the polygon, apart from any holes. */
+            point_t corners[4] = { { rect_.MinX, rect_.MinY }, { rect_.MaxX, rect_.MinY },
+                                   { rect_.MaxX, rect_.MaxY }, { rect_.MinX, rect_.MaxY } };
+            exteriors.push_back(ring_t(corners, corners + 4));
+        }
+
+        size_t first = out->size();
+        for (size_t i = 0; i < exteriors.size(); i++)
+            out->push_back(ring_list_t(1, exteriors[i]));
+        for (size_t i = 0; i < holes.size(); i++) {
+            /* Find a point on the hole that's not on the boundary, and put
+             * the hole in whichever piece that's inside. */
+            const ring_t &hole = holes[i];
+            point_t p = hole[0];
+            for (size_t k = 0, j = hole.size() - 1; k < hole.size(); j = k++) {
+                point_t mid = { (hole[j].x + hole[k].x) / 2, (hole[j].y + hole[k].y) / 2 };
+                if (!on_boundary(hole[k])) {
+                    p = hole[k];
+                    break;
+                }
+                if (!on_boundary(mid)) p = mid;
+            }
+            for (size_t k = first; k < out->size(); k++) {
+                if (point_in_ring((*out)[k][0], p)) {
+                    (*out)[k].push_back(holes[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+    static bool point_in_ring(const ring_t &ring, const point_t &p) {
+        bool inside = false;
+        for (size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++)
+            if ((ring[i].y > p.y) != (ring[j].y > p.y)
+                    && p.x < (ring[j].x - ring[i].x) * (p.y - ring[i].y)
+                             / (ring[j].y - ring[i].y) + ring[i].x)
+                inside = !inside;
+        return inside;
+    }
+
+private:
+    void close_chain() {
+        if (open_) {
+            /* The ring started inside, so the chain that's still open runs
+             * on into the one it started with. */
+            chain_.insert(chain_.end(), head_.begin() + (head_.empty() ? 0 : 1), head_.end());
+            push_chain(chain_);
+        }
+    }
+
+    bool on_boundary(const point_t &p) const {
+        return p.x == rect_.MinX || p.x == rect_.MaxX || p.y == rect_.MinY || p.y == rect_.MaxY;
+    }
+
+    void add_edge(const point_t &a, const point_t &b) {
+        if (!in_rect(b, rect_)) all_inside_ = false;
+        if ((a.y > centre_.y) != (b.y > centre_.y)
+                && centre_.x < (b.x - a.x) * (centre_.y - a.y) / (b.y - a.y) + a.x)
+            parity_ = !parity_;
+
+        point_t ca, cb;
+        if (!clip_segment(a, b, rect_, &ca, &cb)) return;
+        if (!open_) {
+            chain_.clear();
+            chain_.push_back(ca);
+            open_ = true;
+        }
+        if (!same_point(chain_.back(), cb)) chain_.push_back(cb);
+        if (!same_point(cb, b)) {
+            /* It leaves the rectangle here. */
+            if (head_open_) {
+                head_.swap(chain_);
+                head_open_ = false;
+            } else
+                push_chain(chain_);
+            chain_.clear();
+            open_ = false;
+        }
+    }
+
+    void push_chain(const ring_t &chain) {
+        /* Chains that just run along the boundary don't enclose anything,
+         * and going round the boundary covers them anyway. */
+        for (size_t i = 1; i < chain.size(); i++) {
+            const point_t &a = chain[i - 1], &b = chain[i];
+            if (!((a.x == b.x && (a.x == rect_.MinX || a.x == rect_.MaxX))
+                    || (a.y == b.y && (a.y == rect_.MinY || a.y == rect_.MaxY)))) {
+                chains_.push_back(chain);
+                return;
+            }
+        }
+    }
+
+    void follow_chains(std::vector<ring_t> *exteriors) {
+        double w = rect_.MaxX - rect_.MinX, h = rect_.MaxY - rect_.MinY,
+               perimeter = 2 * (w + h),
+               corner_at[4] = { 0, w, w + h, 2 * w + h };
+        point_t corners[4] = { { rect_.MinX, rect_.MinY }, { rect_.MaxX, rect_.MinY },
+                               { rect_.MaxX, rect_.MaxY }, { rect_.MinX, rect_.MaxY } };
+        size_t n = chains_.size();
+        std::vector<double> starts(n), ends(n);
+        std::vector<bool> used(n, false);
+        for (size_t i = 0; i < n; i++) {
+            starts[i] = perimeter_position(chains_[i].front(), rect_);
+            ends[i] = perimeter_position(chains_[i].back(), rect_);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (used[i]) continue;
+            ring_t ring;
+            size_t j = i;
+            while (!used[j]) {
+                used[j] = true;
+                for (size_t k = 0; k < chains_[j].size(); k++)
+                    if (ring.empty() || !same_point(ring.back(), chains_[j][k]))
+                        ring.push_back(chains_[j][k]);
+
+                /* Go counterclockwise round to the nearest chain start. */
+                size_t next = n;
+                double gap = 0;
+                for (size_t k = 0; k < n; k++) {
+                    if (used[k] && k != i) continue;
+                    double d = fmod(starts[k] - ends[j] + perimeter, perimeter);
+                    if (next == n || d < gap) {
+                        next = k;
+                        gap = d;
+                    }
+                }
+                if (next == n) break;
+                std::vector<std::pair<double, int> > passed;
+                for (int k = 0; k < 4; k++) {
+                    /* Add the corners we go past, in order. */
+                    double d = fmod(corner_at[k] - ends[j] + perimeter, perimeter);
+                    if (d > 0 && d < gap) passed.push_back(std::make_pair(d, k));
+                }
+                std::sort(passed.begin(), passed.end());
+                for (size_t k = 0; k < passed.size(); k++)
+                    ring.push_back(corners[passed[k].second]);
+                j = next;
+            }
+            while (ring.size() > 1 && same_point(ring.front(), ring.back()))
+                ring.pop_back();
+            if (ring.size() >= 3 && signed_area(ring) > 0)
+                exteriors->push_back(ring);
+        }
+    }
+
+    const OGREnvelope rect_;
+    point_t centre_, first_, prev_;
+    bool first_point_, all_inside_, open_, head_open_, parity_, outside_parity_;
+    size_t ring_chains_;
+    ring_t chain_, head_, whole_;
+    std::vector<ring_t> chains_, whole_rings_;
+};
+
+/* Coverage mode splits a whole layer at once, for coverages like
+ * administrative boundaries where neighbouring features share their edges.
+ * Rather than each feature getting its own cuts, the layer's extent is
+ * divided into a quadtree of cells, and every feature in a cell is clipped
+ * to the same cell boundaries with RectClipper. So where two neighbours'
+ * shared boundary is cut, both of them get exactly the same vertex, and
+ * their pieces still share edges exactly. */
+typedef struct {
+    size_t feature;
+    ring_list_t rings;
+} coverage_part_t;
+typedef std::vector<coverage_part_t> coverage_t;
+
+void geometry_rings(OGRGeometry *geometry, std::vector<ring_list_t> *polygons) {
+    /* Convert each polygon of a (multi)polygon to a ring list, and push it
+     * onto the polygons vector. */
+    if (geometry == NULL) return;
+    if (geometry->getGeometryType() == wkbMultiPolygon) {
+        OGRMultiPolygon *multi = (OGRMultiPolygon*) geometry;
+        for (int i = 0; i < multi->getNumGeometries(); i++)
+            geometry_rings(multi->getGeometryRef(i), polygons);
+    } else if (geometry->getGeometryType() == wkbPolygon) {
+        ring_list_t rings;
+        polygon_to_rings((OGRPolygon*) geometry, &rings);
+        if (!rings.empty()) polygons->push_back(rings);
+    }
+}
+
+void ring_envelope(const ring_t &ring, OGREnvelope *envelope) {
+    envelope->MinX = envelope->MaxX = ring[0].x;
+    envelope->MinY = envelope->MaxY = ring[0].y;
+    for (size_t i = 1; i < ring.size(); i++) {
+        envelope->MinX = std::min(envelope->MinX, ring[i].x);
+        envelope->MaxX = std::max(envelope->MaxX, ring[i].x);
+        envelope->MinY = std::min(envelope->MinY, ring[i].y);
+        envelope->MaxY = std::max(envelope->MaxY, ring[i].y);
+    }
+}
+
+int ring_cuts(const ring_list_t &rings, const split_limits_t &limits, int depth) {
+    /* The same as needed_cuts(), for a ring list. */
+    if (depth >= MAXDEPTH)
+        return CUT_NONE;
+    if ((int) rings[0].size() + 1 > limits.max_vertices)
+        return CUT_X | CUT_Y;
+    if (limits.max_holes >= 0 && (int) rings.size() - 1 > limits.max_holes)
+        return CUT_X | CUT_Y;
+
+    OGREnvelope envelope;
+    ring_envelope(rings[0], &envelope);
+    if (limits.max_fill > 0) {
+        double area = 0,
+               box_area = (envelope.MaxX - envelope.MinX) * (envelope.MaxY - envelope.MinY);
+        for (size_t i = 0; i < rings.size(); i++)
+            area += signed_area(rings[i]);
+        if (box_area > limits.max_fill * area)
+            return CUT_X | CUT_Y;
+    }
+    return extent_cuts(envelope, limits);
+}
+
+void clip_rings(const ring_list_t &rings, const OGREnvelope &rect,
+                std::vector<ring_list_t> *out) {
+    /* Clip a ring list to the rectangle, pushing whatever's left onto out.
+     * Polygons entirely inside or outside it don't need the clipper. */
+    OGREnvelope envelope;
+    ring_envelope(rings[0], &envelope);
+    if (envelope.MinX > rect.MaxX || envelope.MaxX < rect.MinX
+            || envelope.MinY > rect.MaxY || envelope.MaxY < rect.MinY)
+        return;
+    if (envelope.MinX >= rect.MinX && envelope.MaxX <= rect.MaxX
+            && envelope.MinY >= rect.MinY && envelope.MaxY <= rect.MaxY) {
+        out->push_back(rings);
+        return;
+    }
+    RectClipper clipper(rect);
+    for (size_t i = 0; i < rings.size(); i++) {
+        clipper.begin_ring();
+        for (size_t k = 0; k < rings[i].size(); k++)
+            clipper.add_point(rings[i][k]);
+        clipper.end_ring();
+    }
+    clipper.finish(out);
+}
+
+bool rings_touch(const OGRPolygon *polygon) {
+    /* Whether any of the polygon's rings touch themselves or each other,
+     * i.e. have a vertex in common, or if it has no exterior to speak of. */
+    ring_list_t rings;
+    polygon_to_rings(polygon, &rings);
+    if (rings.empty()) return true;
+    std::vector<std::pair<double, double> > points;
+    for (size_t i = 0; i < rings.size(); i++)
+        for (size_t k = 0; k < rings[i].size(); k++)
+            points.push_back(std::make_pair(rings[i][k].x, rings[i][k].y));
+    std::sort(points.begin(), points.end());
+    return std::adjacent_find(points.begin(), points.end()) != points.end();
+}
+
+OGRGeometry *clip_polygon(const OGRPolygon *polygon, const OGREnvelope &rect) {
+    /* Clip the polygon to the rectangle with clip_rings(), returning what's
+     * left as a new (multi)polygon, which is empty if nothing is. */
+    ring_list_t rings;
+    polygon_to_rings(polygon, &rings);
+    std::vector<ring_list_t> out;
+    if (!rings.empty())
+        clip_rings(rings, rect, &out);
+    if (out.size() == 1)
+        return rings_to_polygon(out[0]);
+    OGRMultiPolygon *multi = new OGRMultiPolygon;
+    for (size_t i = 0; i < out.size(); i++)
+        multi->addGeometryDirectly(rings_to_polygon(out[i]));
+    return multi;
+}
+
+void split_coverage(OGRPolyList *pieces, std::vector<size_t> *owners,
+                    std::vector<int> *depths, const coverage_t &parts,
+                    const OGREnvelope &cell, const split_limits_t &limits, int depth) {
+    /* split_coverage recursively divides the cell into quadrants until
+     * every part in it fits the limits, and pushes each resulting piece
+     * onto the pieces vector, with the index of the feature it came from
+     * onto owners, and the depth of its cell onto depths. Every part in a cell is cut if any one of them needs to
+     * be, which is what keeps the neighbours' boundaries the same. */
+    int cuts = CUT_NONE;
+    for (size_t i = 0; i < parts.size() && cuts != (CUT_X | CUT_Y); i++)
+        cuts |= ring_cuts(parts[i].rings, limits, depth);
+
+    if (cuts == CUT_NONE) {
+        for (size_t i = 0; i < parts.size(); i++) {
+            pieces->push_back(rings_to_polygon(parts[i].rings));
+            owners->push_back(parts[i].feature);
+            depths->push_back(depth);
+        }
+        return;
+    }
+
+    double midX = (cell.MinX + cell.MaxX) / 2,
+           midY = (cell.MinY + cell.MaxY) / 2;
+
+    for (int quadrant = 0; quadrant < 4; quadrant++) {
+        /* Bit 2 of the quadrant picks the right half, and bit 1 the top. */
+        if ((quadrant & 2) && !(cuts & CUT_X)) continue;
+        if ((quadrant & 1) && !(cuts & CUT_Y)) continue;
+        OGREnvelope bbox(cell);
+        if (cuts & CUT_X) {
+            if (quadrant & 2) bbox.MinX = midX; else bbox.MaxX = midX;
+        }
+        if (cuts & CUT_Y) {
+            if (quadrant & 1) bbox.MinY = midY; else bbox.MaxY = midY;
+        }
+
+        coverage_t clipped;
+        for (size_t i = 0; i < parts.size(); i++) {
+            std::vector<ring_list_t> out;
+            clip_rings(parts[i].rings, bbox, &out);
+            for (size_t k = 0; k < out.size(); k++) {
+                coverage_part_t part;
+                part.feature = parts[i].feature;
+                clipped.push_back(part);
+                clipped.back().rings.swap(out[k]);
+            }
+        }
+        if (!clipped.empty())
+            split_coverage(pieces, owners, depths, clipped, bbox, limits, depth + 1);
+    }
+}
+
+void stash_rings(OGRGeometry *geometry, feature_id_t id, coverage_t *parts,
+                 std::vector<feature_id_t> *ids, OGREnvelope *extent) {
+    /* Add each polygon of the (multi)polygon to the parts, as belonging to
+     * a new feature with this ID, and grow the extent to cover it. */
+    std::vector<ring_list_t> polygons;
+    geometry_rings(geometry, &polygons);
+    for (size_t i = 0; i < polygons.size(); i++) {
+        OGREnvelope envelope;
+        ring_envelope(polygons[i][0], &envelope);
+        if (parts->empty()) *extent = envelope;
+        else extent->Merge(envelope);
+        coverage_part_t part;
+        part.feature = ids->size();
+        parts->push_back(part);
+        parts->back().rings.swap(polygons[i]);
+    }
+    ids->push_back(id);
+}
+
+static inline std::pair<double, double> point_key(const point_t &p) {
+    return std::make_pair(p.x, p.y);
+}
+
+void prune_coverage(coverage_t *parts, double tolerance) {
+    /* Prune every ring of the coverage as prune_ring() would, but so that
+     * neighbours' shared boundaries stay identical. Vertices where anything
+     * other than two of the layer's edges meet, such as where three features
+     * do, are always kept, and every stretch of boundary between two of them
+     * is pruned as prune_chain() does, starting from whichever end sorts
+     * first, whichever ring it's in and whichever way that ring runs. So it
+     * comes out the same for both neighbours, as if the layer's boundaries
+     * were pruned once. */
+    typedef std::pair<double, double> key_t;
+    std::vector<key_t> nodes;
+    {
+        std::vector<std::pair<key_t, key_t> > edges;
+        for (size_t i = 0; i < parts->size(); i++) {
+            const ring_list_t &rings = (*parts)[i].rings;
+            for (size_t r = 0; r < rings.size(); r++)
+                for (size_t k = 0, n = rings[r].size(); k < n; k++) {
+                    key_t a = point_key(rings[r][k]), b = point_key(rings[r][(k + 1) % n]);
+                    edges.push_back(a < b ? std::make_pair(a, b) : std::make_pair(b, a));
+                }
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+        std::vector<key_t> ends;
+        for (size_t i = 0; i < edges.size(); i++) {
+            ends.push_back(edges[i].first);
+            ends.push_back(edges[i].second);
+        }
+        std::vector<std::pair<key_t, key_t> >().swap(edges);
+        std::sort(ends.begin(), ends.end());
+        for (size_t i = 0, j; i < ends.size(); i = j) {
+            for (j = i + 1; j < ends.size() && ends[j] == ends[i]; j++) ;
+            if (j - i != 2) nodes.push_back(ends[i]);
+        }
+    }
+
+    for (size_t i = 0; i < parts->size(); i++) {
+        ring_list_t &rings = (*parts)[i].rings;
+        for (size_t r = 0; r < rings.size(); r++) {
+            ring_t &ring = rings[r];
+            size_t n = ring.size();
+            std::vector<size_t> at;
+            for (size_t k = 0; k < n; k++)
+                if (std::binary_search(nodes.begin(), nodes.end(), point_key(ring[k])))
+                    at.push_back(k);
+
+            if (at.empty()) {
+                /* The whole ring is one stretch, shared with at most the
+                 * ring of a feature filling it or a hole around it, so
+                 * start it at its first vertex in sorted order. */
+                size_t first = 0;
+                for (size_t k = 1; k < n; k++)
+                    if (point_key(ring[k]) < point_key(ring[first])) first = k;
+                bool backwards = point_key(ring[(first + n - 1) % n])
+                                 < point_key(ring[(first + 1) % n]);
+                ring_t chain;
+                for (size_t k = 0; k <= n; k++)
+                    chain.push_back(ring[(first + (backwards ? n - k : k)) % n]);
+                prune_chain(&chain, tolerance);
+                chain.pop_back();
+                if (backwards) std::reverse(chain.begin() + 1, chain.end());
+                if (chain.size() >= 3) ring.swap(chain);
+                continue;
+            }
+
+            ring_t pruned;
+            for (size_t j = 0; j < at.size(); j++) {
+                size_t from = at[j], to = (j + 1 < at.size() ? at[j + 1] : at[0] + n);
+                ring_t chain;
+                for (size_t k = from; k <= to; k++)
+                    chain.push_back(ring[k % n]);
+                key_t head = point_key(chain.front()), tail = point_key(chain.back());
+                bool backwards = tail < head
+                    || (tail == head && chain.size() > 2
+                        && point_key(chain[chain.size() - 2]) < point_key(chain[1]));
+                if (backwards) std::reverse(chain.begin(), chain.end());
+                prune_chain(&chain, tolerance);
+                if (backwards) std::reverse(chain.begin(), chain.end());
+                pruned.insert(pruned.end(), chain.begin(), chain.end() - 1);
+            }
+            if (pruned.size() >= 3) ring.swap(pruned);
+        }
+    }
+}
+
+void grid_polygons(OGRPolyList *pieces, OGRGeometry *geometry,
+                   const split_limits_t &limits) {
+    /* Split the (multi)polygon by clipping it to a quadtree of rectangles
+     * over its bounding box, as split_coverage() does for a whole layer.
+     * The cuts aren't as well placed as split_polygons()' are, but it never
+     * goes through GEOS, and it's guaranteed to finish quickly. */
+    std::vector<ring_list_t> polygons;
+    geometry_rings(geometry, &polygons);
+    if (polygons.empty()) return;
+
+    coverage_t parts(polygons.size());
+    OGREnvelope extent, envelope;
+    for (size_t i = 0; i < polygons.size(); i++) {
+        ring_envelope(polygons[i][0], &envelope);
+        if (i == 0) extent = envelope;
+        else extent.Merge(envelope);
+        parts[i].feature = 0;
+        parts[i].rings.swap(polygons[i]);
+    }
+    std::vector<size_t> owners;
+    std::vector<int> depths;
+    split_coverage(pieces, &owners, &depths, parts, extent, limits, 0);
+}
+
+void split_within_budget(OGRPolyList *pieces, OGRGeometry *geometry,
+                         const split_limits_t &limits, split_state_t *state) {
+    /* split_polygons() the geometry, unless that goes over the time or node
+     * budget in the state, in which case whatever it made so far is thrown
+     * away and grid_polygons() is used instead; once the budget has run
+     * out, later calls for the same feature go straight to the grid.
+     * Afterwards, the state says whether it had to fall back, and what
+     * went wrong, if anything, and has the depth of each of the pieces,
+     * which isn't known for those grid_polygons() made. The rectangle
+     * clipper needs edges that don't cross, so invalid geometry is tidied
+     * up first, as split_polygons() would have done. */
+    size_t first = pieces->size();
+    const char *error = state->error;
+    state->depths.assign(first, -1);
+    if (!state->exceeded) {
+        split_polygons(pieces, geometry, limits, 0, CLIP_NONE, state);
+        if (!state->exceeded)
+            return;
+    }
+
+    for (size_t i = first; i < pieces->size(); i++)
+        delete (*pieces)[i];
+    pieces->resize(first);
+    state->error = error;
+    OGRGeometry *tidy = NULL;
+    if (!geometry->IsValid()) {
+        tidy = geometry->Buffer(0);
+        if (tidy == NULL || !tidy->IsValid()) {
+            delete tidy;
+            state->error = "GEOS couldn't tidy up an invalid polygon";
+            state->depths.assign(first, -1);
+            return;
+        }
+    }
+    grid_polygons(pieces, tidy != NULL ? tidy : geometry, limits);
+    delete tidy;
+    state->depths.assign(pieces->size(), -1);
+}
+
+/* How far approximations are nudged outward or inward, relative to their
+ * size, so that rounding in the corner computations can't take them across
+ * the boundary they're supposed to stay on one side of. */
+#define APPROXSLACK 1e-9
+
+static void scale_ring(ring_t *ring, double factor) {
+    /* Scale the ring about its vertex centroid. */
+    point_t c = { 0, 0 };
+    for (size_t i = 0; i < ring->size(); i++) {
+        c.x += (*ring)[i].x / ring->size();
+        c.y += (*ring)[i].y / ring->size();
+    }
+    for (size_t i = 0; i < ring->size(); i++) {
+        (*ring)[i].x = c.x + ((*ring)[i].x - c.x) * factor;
+        (*ring)[i].y = c.y + ((*ring)[i].y - c.y) * factor;
+    }
+}
+
+void shrink_convex(ring_t *ring, size_t max_vertices) {
+    /* Reduce a counterclockwise convex ring to at most max_vertices by
+     * cutting off corners, smallest first. The result stays inside the
+     * original. */
+    while (ring->size() > max_vertices && ring->size() > 3) {
+        size_t n = ring->size(), best = 0;
+        double best_area = -1;
+        for (size_t i = 0; i < n; i++) {
+            double area = orient((*ring)[(i + n - 1) % n], (*ring)[i], (*ring)[(i + 1) % n]);
+            if (best_area < 0 || area < best_area) {
+                best_area = area;
+                best = i;
+            }
+        }
+        ring->erase(ring->begin() + best);
+    }
+}
+
+void grow_convex(ring_t *ring, size_t max_vertices) {
+    /* Reduce a counterclockwise convex ring to at most max_vertices by
+     * dropping edges, and extending the edges on either side until they
+     * meet. The edge that adds the least area goes first. The result
+     * contains the original. An edge can only go if its neighbours turn by
+     * less than a half turn in total, so squares, for instance, stay as
+     * they are. */
+    while (ring->size() > max_vertices && ring->size() > 3) {
+        size_t n = ring->size(), best = n;
+        double best_area = -1;
+        point_t best_corner = { 0, 0 };
+        for (size_t i = 0; i < n; i++) {
+            const point_t &a = (*ring)[(i + n - 1) % n], &b = (*ring)[i],
+                          &c = (*ring)[(i + 1) % n], &d = (*ring)[(i + 2) % n];
+            double dx1 = b.x - a.x, dy1 = b.y - a.y,
+                   dx2 = d.x - c.x, dy2 = d.y - c.y,
+                   denominator = dx1 * dy2 - dy1 * dx2;
+            if (denominator <= 0) continue;
+            double t = ((c.x - a.x) * dy2 - (c.y - a.y) * dx2) / denominator;
+            point_t corner = { a.x + t * dx1, a.y + t * dy1 };
+            double area = orient(b, corner, c);
+            if (area < 0) area = -area;
+            if (best == n || area < best_area) {
+                best = i;
+                best_area = area;
+                best_corner = corner;
+            }
+        }
+        if (best == n) break;
+        (*ring)[best] = best_corner;
+        ring->erase(ring->begin() + (best + 1) % n);
+    }
+}
+
+void approximate_polygons(OGRPolyList *inner, OGRPolyList *outer, OGRGeometry *geometry,
+                          const split_limits_t &limits, int approx_vertices,
+                          split_state_t *state) {
+    /* approximate_polygons pushes a convex polygon of at most
+     * approx_vertices that lies entirely inside each component polygon onto
+     * the inner vector, and one that entirely contains it onto the outer
+     * vector. A point lookup can accept anything inside the inner one and
+     * reject anything outside the outer one without looking at the real
+     * pieces, which only matter near the boundary.
+     *
+     * The outer approximation is the convex hull, with its shortest edges
+     * extended away. The inner one is the largest convex_polygons() piece,
+     * with its smallest corners cut off, or the next largest if that isn't
+     * inside the polygon after all; if none is, there's no inner one.
+     * convex_polygons() spends what's left of the feature's budget in the
+     * state, but leaves its depths and error alone: a lost part only means
+     * a smaller inner approximation. */
+    if (geometry == NULL || geometry->IsEmpty())
+        return;
+
+    if (geometry->getGeometryType() == wkbMultiPolygon) {
+        OGRMultiPolygon *multi = (OGRMultiPolygon*) geometry;
+        for (int i = 0; i < multi->getNumGeometries(); i++)
+            approximate_polygons(inner, outer, multi->getGeometryRef(i),
+                                 limits, approx_vertices, state);
+        return;
+    }
+    if (geometry->getGeometryType() != wkbPolygon)
+        return;
+
+    OGRGeometry *hull = geometry->ConvexHull();
+    if (hull != NULL && hull->getGeometryType() == wkbPolygon) {
+        ring_list_t rings;
+        polygon_to_rings((OGRPolygon*) hull, &rings);
+        if (!rings.empty()) {
+            grow_convex(&rings[0], approx_vertices);
+            scale_ring(&rings[0], 1 + APPROXSLACK);
+            outer->push_back(ring_to_polygon(rings[0]));
+        }
+    }
+    delete hull;
+
+    OGRPolyList convex;
+    std::vector<int> depths;
+    const char *error = state->error;
+    depths.swap(state->depths);
+    convex_polygons(&convex, geometry, limits, state);
+    depths.swap(state->depths);
+    state->error = error;
+    std::vector<std::pair<double, OGRPolygon*> > by_area;
+    for (OGRPolyList::iterator it = convex.begin(); it != convex.end(); it++)
+        by_area.push_back(std::make_pair(-(*it)->get_Area(), *it));
+    std::sort(by_area.begin(), by_area.end());
+    for (size_t i = 0; i < by_area.size(); i++) {
+        ring_list_t rings;
+        polygon_to_rings(by_area[i].second, &rings);
+        if (rings.empty()) continue;
+        shrink_convex(&rings[0], approx_vertices);
+        scale_ring(&rings[0], 1 - APPROXSLACK);
+        OGRPolygon *approximation = ring_to_polygon(rings[0]);
+        if (geometry->Contains(approximation)) {
+            inner->push_back(approximation);
+            break;
+        }
+        delete approximation;
+    }
+    for (OGRPolyList::iterator it = convex.begin(); it != convex.end(); it++)
+        delete *it;
+}
+
+/* The layer-wide point location index. The plane is cut into horizontal
+ * slabs at every vertex y coordinate in the layer, and within each slab the
+ * edges crossing it are listed left to right, each with the feature lying to
+ * its right. A lookup is then two binary searches, one for the slab and one
+ * for the edge, no matter how many features there are. Edges shared by two
+ * features are stored once. The space is quadratic in the worst case, but
+ * closer to n^1.5 for typical coverages.
+ *
+ * With a precision, every coordinate is snapped to a multiple of it before
+ * the index is built, and the edges are stored as whole multiples of it, in
+ * blocks of INDEXBLOCK. Each block has a 64-bit origin, and its edges are
+ * 32-bit offsets from that, which takes half the space of doubles. The
+ * edges are put in Morton order first, so that each block covers a small
+ * area. They stay that way in memory, and are decoded as they're looked at,
+ * so a lookup gives exactly the same answer as it would for the snapped
+ * coordinates stored as doubles.
+ *
+ * The file is written in native byte order:
+ *
+ *   char     magic[4]            "PSLI"
+ *   uint32   version, n_features, n_edges, n_slabs, n_entries
+ *   double   precision           or 0 if the edges are doubles
+ *   int32    ids[n_features]     feature ID of each label
+ *   double   edges[n_edges][4]   lo.x, lo.y, hi.x, hi.y, if the precision is 0
+ *   int64    origins[n_blocks][2] x, y of each block, as multiples of the
+ *                                precision, if it isn't
+ *   int32    edges[n_edges][4]   lo.x, lo.y, hi.x, hi.y, less the origin
+ *                                of the block, if it isn't
+ *   double   stops[n_slabs + 1]  slab boundaries, bottom to top
+ *   uint32   offsets[n_slabs + 1] first entry of each slab
+ *   uint32   entries[n_entries][2] edge index, label (NOLABEL if outside)
+ *
+ * The edges can also be compressed, a block at a time, with one of the
+ * codecs GDAL has had since 3.4. Then, in place of the edges above, there's
+ * a directory of where each compressed block starts, followed by the blocks,
+ * each of which is a block's origin and edges, or just its edges if they're
+ * doubles. A lookup only decompresses the blocks it looks at, and keeps the
+ * last few it needed.
+ *
+ *   uint32   codec               after the precision; 0 for none, or the
+ *                                position of its name in index_codecs
+ *   uint64   blocks[n_blocks + 1] where each block starts, after the last
+ *   char     packed[blocks[n_blocks]] the compressed blocks
+ *
+ * Only files of the current version can be read, and everything in them
+ * that a lookup uses to find its way is checked first, so that a broken or
+ * hostile file is turned down instead of sending a lookup out of bounds. */
+#define INDEXMAGIC "PSLI"
+#define INDEXVERSION 3
+#define INDEXBLOCK 256
+#define INDEXCACHE 64       // decompressed blocks kept for lookups
+#define NOLABEL 0xFFFFFFFFu
+#define INDEXMAXCOUNT 0xFFFFFFFFu   // of edges, or of entries in all the slabs
+
+#if GDAL_VERSION_MAJOR > 3 || (GDAL_VERSION_MAJOR == 3 && GDAL_VERSION_MINOR >= 4)
+#define INDEX_COMPRESSION 1
+#endif
+static const char *const index_codecs[] = { "none", "deflate", "zstd", "lz4", NULL };
+
+typedef struct {
+    std::vector<feature_id_t> ids;
+    std::vector<segment_t> edges;   // if the precision is 0
+    double precision;
+    std::vector<int64_t> origins;   // otherwise
+    std::vector<int32_t> coords;
+    uint32_t codec;                 // if the edges are compressed instead
+    size_t n_edges;
+    std::vector<uint64_t> blocks;
+    std::vector<char> packed;
+    mutable std::vector<std::pair<size_t, std::vector<char> > > cache;
+    std::vector<double> stops;
+    std::vector<uint32_t> offsets, entries;
+} location_index_t;
+
+void geometry_segments(OGRGeometry *geometry, int owner, std::vector<segment_t> *segments) {
+    /* Push the edges of every ring of the (multi)polygon onto the vector. */
+    if (geometry == NULL || geometry->IsEmpty())
+        return;
+    if (geometry->getGeometryType() == wkbMultiPolygon) {
+        OGRMultiPolygon *multi = (OGRMultiPolygon*) geometry;
+        for (int i = 0; i < multi->getNumGeometries(); i++)
+            geometry_segments(multi->getGeometryRef(i), owner, segments);
+        return;
+    }
+    if (geometry->getGeometryType() != wkbPolygon)
+        return;
+    ring_list_t rings;
+    polygon_to_rings((OGRPolygon*) geometry, &rings);
+    for (size_t i = 0; i < rings.size(); i++)
+        ring_segments(rings[i], owner, segments);
+}
+
+static bool segment_less(const segment_t &a, const segment_t &b) {
+    if (a.lo.y != b.lo.y) return a.lo.y < b.lo.y;
+    if (a.lo.x != b.lo.x) return a.lo.x < b.lo.x;
+    if (a.hi.y != b.hi.y) return a.hi.y < b.hi.y;
+    return a.hi.x < b.hi.x;
+}
+
+struct SegmentLess {
+    const std::vector<segment_t> &s;
+    SegmentLess(const std::vector<segment_t> &s) : s(s) {}
+    bool operator()(int a, int b) const { return segment_less(s[a], s[b]); }
+};
+
+static inline double snap(double value, double precision) {
+    return floor(value / precision + 0.5) * precision;
+}
+
+static void snap_segments(std::vector<segment_t> *segments, double precision) {
+    /* Snap the segments' coordinates to multiples of the precision,
+     * dropping any that end up horizontal. */
+    size_t kept = 0;
+    for (size_t i = 0; i < segments->size(); i++) {
+        segment_t s = (*segments)[i];
+        s.lo.x = snap(s.lo.x, precision);
+        s.lo.y = snap(s.lo.y, precision);
+        s.hi.x = snap(s.hi.x, precision);
+        s.hi.y = snap(s.hi.y, precision);
+        if (s.lo.y != s.hi.y) (*segments)[kept++] = s;
+    }
+    segments->resize(kept);
+}
+
+static inline uint64_t morton_code(uint32_t x, uint32_t y) {
+    /* Interleave the bits of x and y. */
+    uint64_t code = 0;
+    for (int bit = 0; bit < 32; bit++)
+        code |= ((uint64_t) ((x >> bit) & 1) << (2 * bit))
+                | ((uint64_t) ((y >> bit) & 1) << (2 * bit + 1));
+    return code;
+}
+
+static bool quantise_edges(location_index_t *index) {
+    /* Put the index's edges in Morton order of their midpoints, and store
+     * them as offsets from the origin of their block. Returns false, and
+     * leaves the index alone, if some block is too big for 32-bit offsets
+     * at this precision. */
+    size_t n = index->edges.size();
+    if (n == 0) return true;
+    OGREnvelope extent;
+    extent.MinX = extent.MaxX = index->edges[0].lo.x;
+    extent.MinY = extent.MaxY = index->edges[0].lo.y;
+    for (size_t i = 0; i < n; i++) {
+        const segment_t &e = index->edges[i];
+        extent.MinX = std::min(extent.MinX, std::min(e.lo.x, e.hi.x));
+        extent.MaxX = std::max(extent.MaxX, std::max(e.lo.x, e.hi.x));
+        extent.MinY = std::min(extent.MinY, e.lo.y);
+        extent.MaxY = std::max(extent.MaxY, e.hi.y);
+    }
+    double width = std::max(extent.MaxX - extent.MinX, index->precision),
+           height = std::max(extent.MaxY - extent.MinY, index->precision);
+    std::vector<std::pair<uint64_t, uint32_t> > order(n);
+    for (size_t i = 0; i < n; i++) {
+        const segment_t &e = index->edges[i];
+        double x = ((e.lo.x + e.hi.x) / 2 - extent.MinX) / width,
+               y = ((e.lo.y + e.hi.y) / 2 - extent.MinY) / height;
+        order[i] = std::make_pair(morton_code((uint32_t) (x * 65535), (uint32_t) (y * 65535)),
+                                  (uint32_t) i);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<int64_t> origins, units(4 * n);
+    std::vector<int32_t> coords(4 * n);
+    for (size_t i = 0; i < n; i++) {
+        const segment_t &e = index->edges[order[i].second];
+        units[4 * i] = (int64_t) floor(e.lo.x / index->precision + 0.5);
+        units[4 * i + 1] = (int64_t) floor(e.lo.y / index->precision + 0.5);
+        units[4 * i + 2] = (int64_t) floor(e.hi.x / index->precision + 0.5);
+        units[4 * i + 3] = (int64_t) floor(e.hi.y / index->precision + 0.5);
+    }
+    for (size_t first = 0; first < n; first += INDEXBLOCK) {
+        /* Each block's origin is the middle of its bounding box. */
+        size_t last = std::min(n, first + INDEXBLOCK);
+        int64_t lo[2] = { units[4 * first], units[4 * first + 1] },
+                hi[2] = { lo[0], lo[1] };
+        for (size_t k = 4 * first; k < 4 * last; k++) {
+            lo[k & 1] = std::min(lo[k & 1], units[k]);
+            hi[k & 1] = std::max(hi[k & 1], units[k]);
+        }
+        for (int axis = 0; axis < 2; axis++) {
+            int64_t origin = lo[axis] + (hi[axis] - lo[axis]) / 2;
+            if (hi[axis] - origin > INT32_MAX || lo[axis] - origin < INT32_MIN)
+                return false;
+            origins.push_back(origin);
+        }
+        for (size_t k = 4 * first; k < 4 * last; k++)
+            coords[k] = (int32_t) (units[k] - origins[origins.size() - 2 + (k & 1)]);
+    }
+
+    std::vector<uint32_t> moved(n);
+    for (size_t i = 0; i < n; i++)
+        moved[order[i].second] = i;
+    for (size_t i = 0; i < index->entries.size(); i += 2)
+        index->entries[i] = moved[index->entries[i]];
+    index->origins.swap(origins);
+    index->coords.swap(coords);
+    std::vector<segment_t>().swap(index->edges);
+    return true;
+}
+
+static size_t index_block_bytes(const location_index_t &index, size_t block) {
+    /* How big a block of edges is, uncompressed. */
+    size_t n = std::min((size_t) INDEXBLOCK, index.n_edges - block * INDEXBLOCK);
+    return (index.precision == 0 ? 4 * sizeof(double) * n
+                                 : 2 * sizeof(int64_t) + 4 * sizeof(int32_t) * n);
+}
+
+static bool index_block_data(const location_index_t &index, size_t block,
+                             std::vector<char> *raw) {
+    /* Lay out a block of the index's uncompressed edges as it's stored. */
+    size_t first = block * INDEXBLOCK,
+           last = std::min(index.n_edges, first + INDEXBLOCK);
+    raw->clear();
+    if (index.precision == 0) {
+        for (size_t i = first; i < last; i++) {
+            double edge[4] = { index.edges[i].lo.x, index.edges[i].lo.y,
+                               index.edges[i].hi.x, index.edges[i].hi.y };
+            raw->insert(raw->end(), (const char*) edge, (const char*) (edge + 4));
+        }
+    } else {
+        const char *origin = (const char*) &index.origins[2 * block],
+                   *coords = (const char*) &index.coords[4 * first];
+        raw->insert(raw->end(), origin, origin + 2 * sizeof(int64_t));
+        raw->insert(raw->end(), coords, coords + 4 * sizeof(int32_t) * (last - first));
+    }
+    return raw->size() == index_block_bytes(index, block);
+}
+
+#ifdef INDEX_COMPRESSION
+static bool compress_block(const char *codec, const std::vector<char> &raw,
+                           std::vector<char> *packed) {
+    /* Compress a block, and add it to the end of packed. */
+    const CPLCompressor *compressor = CPLGetCompressor(codec);
+    void *data = NULL;
+    size_t size = 0;
+    if (compressor == NULL || !compressor->pfnFunc(&raw[0], raw.size(), &data, &size,
+                                                   NULL, compressor->user_data))
+        return false;
+    packed->insert(packed->end(), (char*) data, (char*) data + size);
+    VSIFree(data);
+    return true;
+}
+#endif
+
+static const char *index_block(const location_index_t &index, size_t block) {
+    /* Get a compressed block of edges from the cache, decompressing it
+     * into the cache first if it isn't there. A corrupt block is fatal. */
+    if (index.cache.empty())
+        index.cache.resize(INDEXCACHE, std::make_pair((size_t) -1, std::vector<char>()));
+    std::pair<size_t, std::vector<char> > &slot = index.cache[block % INDEXCACHE];
+    if (slot.first == block)
+        return &slot.second[0];
+
+    bool ok = false;
+#ifdef INDEX_COMPRESSION
+    const CPLCompressor *decompressor = CPLGetDecompressor(index_codecs[index.codec]);
+    slot.second.resize(index_block_bytes(index, block));
+    void *data = &slot.second[0];
+    size_t size = slot.second.size();
+    ok = (decompressor != NULL
+          && decompressor->pfnFunc(&index.packed[index.blocks[block]],
+                                   index.blocks[block + 1] - index.blocks[block],
+                                   &data, &size, NULL, decompressor->user_data)
+          && size == slot.second.size());
+#endif
+    if (!ok) {
+        std::cerr << "Can't decompress block " << block << " of the location index.\n";
+        exit( 1 );
+    }
+    slot.first = block;
+    return &slot.second[0];
+}
+
+static inline segment_t index_edge(const location_index_t &index, uint32_t i) {
+    /* Get an edge from the index, decompressing and decoding it if need
+     * be. */
+    if (index.precision == 0 && index.codec == 0) return index.edges[i];
+    const int64_t *origin;
+    const int32_t *c;
+    segment_t s;
+    if (index.codec == 0) {
+        origin = &index.origins[2 * (i / INDEXBLOCK)];
+        c = &index.coords[4 * i];
+    } else {
+        const char *block = index_block(index, i / INDEXBLOCK);
+        if (index.precision == 0) {
+            const double *d = (const double*) block + 4 * (i % INDEXBLOCK);
+            s.lo.x = d[0];
+            s.lo.y = d[1];
+            s.hi.x = d[2];
+            s.hi.y = d[3];
+            s.owner = -1;
+            return s;
+        }
+        origin = (const int64_t*) block;
+        c = (const int32_t*) (block + 2 * sizeof(int64_t)) + 4 * (i % INDEXBLOCK);
+    }
+    s.lo.x = (double) (origin[0] + c[0]) * index.precision;
+    s.lo.y = (double) (origin[1] + c[1]) * index.precision;
+    s.hi.x = (double) (origin[0] + c[2]) * index.precision;
+    s.hi.y = (double) (origin[1] + c[3]) * index.precision;
+    s.owner = -1;
+    return s;
+}
+
+static inline size_t index_edge_count(const location_index_t &index) {
+    return index.n_edges;
+}
+
+bool build_location_index(const std::vector<segment_t> &layer_segments,
+                          const std::vector<feature_id_t> &ids, double precision,
+                          location_index_t *index) {
+    /* Build the index from the edges of every feature in the layer, where
+     * each segment's owner is the position of its feature ID in ids. With
+     * a precision, the edges are snapped and quantised as described above;
+     * if they can't be, the index keeps them as doubles, and its precision
+     * is set back to 0. Returns false if the layer has too many features,
+     * edges or slab entries to number in the index's 32 bits. */
+    if (ids.size() >= NOLABEL || layer_segments.size() > (size_t) INT_MAX)
+        return false;
+    index->ids = ids;
+    index->precision = precision;
+    index->codec = 0;
+    std::vector<segment_t> snapped;
+    if (precision > 0) {
+        snapped = layer_segments;
+        snap_segments(&snapped, precision);
+    }
+    const std::vector<segment_t> &segments = (precision > 0 ? snapped : layer_segments);
+
+    /* Number the distinct edges, so that shared boundaries are kept once. */
+    std::vector<int> order(segments.size());
+    std::vector<uint32_t> edge_of(segments.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), SegmentLess(segments));
+    for (size_t i = 0; i < order.size(); i++) {
+        const segment_t &s = segments[order[i]];
+        if (i == 0 || segment_less(segments[order[i - 1]], s))
+            index->edges.push_back(s);
+        if (index->edges.size() > INDEXMAXCOUNT)
+            return false;
+        edge_of[order[i]] = index->edges.size() - 1;
+    }
+
+    /* Sweep up through the layer. Crossing an edge from left to right
+     * toggles whether we're inside its feature; the label of the region to
+     * the right of an edge is the most recently entered feature that we're
+     * still inside, which for a proper coverage is the only one. */
+    SlabSweep sweep(segments);
+    std::vector<uint32_t> inside;
+    while (sweep.next()) {
+        if (index->stops.empty()) index->stops.push_back(sweep.bottom);
+        index->offsets.push_back(index->entries.size() / 2);
+        inside.clear();
+        for (size_t i = 0; i < sweep.active.size(); i++) {
+            int s = sweep.active[i];
+            uint32_t owner = segments[s].owner;
+            std::vector<uint32_t>::iterator it = std::find(inside.begin(), inside.end(), owner);
+            if (it != inside.end())
+                inside.erase(it);
+            else
+                inside.push_back(owner);
+            if (i + 1 < sweep.active.size() && edge_of[sweep.active[i + 1]] == edge_of[s])
+                continue; // the other side of a shared edge
+            index->entries.push_back(edge_of[s]);
+            index->entries.push_back(inside.empty() ? NOLABEL : inside.back());
+        }
+        if (index->entries.size() / 2 > INDEXMAXCOUNT)
+            return false;
+        index->stops.push_back(sweep.top);
+    }
+    if (index->stops.empty()) index->stops.push_back(0);
+    index->offsets.push_back(index->entries.size() / 2);
+    index->n_edges = index->edges.size();
+    if (precision > 0 && !quantise_edges(index))
+        index->precision = 0;
+    return true;
+}
+
+template <typename T>
+static bool write_array(FILE *out, const std::vector<T> &array) {
+    return array.empty() || fwrite(&array[0], sizeof(T), array.size(), out) == array.size();
+}
+
+template <typename T>
+static bool read_array(FILE *in, std::vector<T> *array, size_t count) {
+    array->resize(count);
+    return count == 0 || fread(&(*array)[0], sizeof(T), count, in) == count;
+}
+
+const char *index_codec(const char *name) {
+    /* Check that the named codec can be used to compress a location index,
+     * and return the name of the one to use instead if it can't be, or
+     * NULL if none can. deflate is always there from GDAL 3.4 on. */
+    bool known = false;
+    for (int i = 1; index_codecs[i] != NULL; i++)
+        known = known || strcmp(name, index_codecs[i]) == 0;
+    if (!known) {
+        std::cerr << "Don't know how to compress with " << name << ".\n";
+        return NULL;
+    }
+#ifdef INDEX_COMPRESSION
+    if (CPLGetCompressor(name) == NULL || CPLGetDecompressor(name) == NULL) {
+        std::cerr << "WARNING: this GDAL can't compress with " << name
+                  << ", so the location index will use deflate.\n";
+        return "deflate";
+    }
+    return name;
+#else
+    std::cerr << "This GDAL is too old to compress the location index.\n";
+    return NULL;
+#endif
+}
+
+bool write_location_index(const char *filename, const location_index_t &index,
+                          const char *codec) {
+    /* Write the index, with its edges compressed by the given codec, which
+     * index_codec() has said is usable, or uncompressed if it's NULL. */
+    uint32_t codec_id = 0;
+    for (int i = 1; codec != NULL && index_codecs[i] != NULL; i++)
+        if (strcmp(codec, index_codecs[i]) == 0) codec_id = i;
+
+    std::vector<double> edges;
+    std::vector<uint64_t> blocks;
+    std::vector<char> packed, raw;
+    if (codec_id != 0) {
+        for (size_t block = 0; block * INDEXBLOCK < index.n_edges; block++) {
+            blocks.push_back(packed.size());
+            bool ok = index_block_data(index, block, &raw);
+#ifdef INDEX_COMPRESSION
+            ok = ok && compress_block(codec, raw, &packed);
+#endif
+            if (!ok) return false;
+        }
+        blocks.push_back(packed.size());
+    } else {
+        for (size_t i = 0; i < index.edges.size(); i++) {
+            edges.push_back(index.edges[i].lo.x);
+            edges.push_back(index.edges[i].lo.y);
+            edges.push_back(index.edges[i].hi.x);
+            edges.push_back(index.edges[i].hi.y);
+        }
+    }
+
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) return false;
+    uint32_t header[5] = { INDEXVERSION, (uint32_t) index.ids.size(),
+                           (uint32_t) index_edge_count(index),
+                           (uint32_t) index.stops.size() - 1,
+                           (uint32_t) index.entries.size() / 2 };
+    bool ok = fwrite(INDEXMAGIC, 1, 4, out) == 4
+              && fwrite(header, sizeof(uint32_t), 5, out) == 5
+              && fwrite(&index.precision, sizeof(double), 1, out) == 1
+              && fwrite(&codec_id, sizeof(uint32_t), 1, out) == 1
+              && write_array(out, index.ids);
+    if (codec_id != 0)
+        ok = ok && write_array(out, blocks) && write_array(out, packed);
+    else
+        ok = ok && write_array(out, edges)
+                && write_array(out, index.origins) && write_array(out, index.coords);
+    ok = ok && write_array(out, index.stops) && write_array(out, index.offsets)
+            && write_array(out, index.entries);
+    return (fclose(out) == 0) && ok;
+}
+
+const char *read_location_index(const char *filename, location_index_t *index) {
+    /* Read the index, and check that its slabs, entries and labels all
+     * point where they should. Returns what's wrong with it, or NULL if
+     * nothing is. */
+    FILE *in = fopen(filename, "rb");
+    if (in == NULL) return "couldn't open it";
+    char magic[4];
+    uint32_t header[5];
+    std::vector<double> edges;
+    index->precision = 0;
+    index->codec = 0;
+    bool ok = fread(magic, 1, 4, in) == 4 && memcmp(magic, INDEXMAGIC, 4) == 0
+              && fread(header, sizeof(uint32_t), 5, in) == 5;
+    if (ok && header[0] != INDEXVERSION) {
+        fclose(in);
+        return "it's from a different version of polysplit; make it again with -l";
+    }
+    ok = ok && fread(&index->precision, sizeof(double), 1, in) == 1
+            && fread(&index->codec, sizeof(uint32_t), 1, in) == 1
+            && index->codec < sizeof(index_codecs) / sizeof(index_codecs[0]) - 1
+            && read_array(in, &index->ids, header[1]);
+    size_t n_edges = header[2], n_slabs = header[3], n_entries = header[4];
+    size_t n_blocks = (n_edges + INDEXBLOCK - 1) / INDEXBLOCK;
+    index->n_edges = n_edges;
+    if (ok && index->codec != 0) {
+        ok = read_array(in, &index->blocks, n_blocks + 1)
+             && read_array(in, &index->packed, index->blocks.back());
+        for (size_t i = 0; ok && i < n_blocks; i++)
+            ok = index->blocks[i] <= index->blocks[i + 1];
+    }
+    else if (ok && index->precision == 0)
+        ok = read_array(in, &edges, n_edges * 4);
+    else if (ok)
+        ok = read_array(in, &index->origins, n_blocks * 2)
+             && read_array(in, &index->coords, n_edges * 4);
+    ok = ok && read_array(in, &index->stops, n_slabs + 1)
+            && read_array(in, &index->offsets, n_slabs + 1)
+            && read_array(in, &index->entries, n_entries * 2);
+    fclose(in);
+    if (!ok) return "it isn't a location index, or it's cut short";
+
+    for (size_t i = 0; i < n_slabs; i++)
+        if (!(index->stops[i] <= index->stops[i + 1])
+                || index->offsets[i] > index->offsets[i + 1])
+            return "its slabs are out of order";
+    if (index->offsets[n_slabs] > n_entries)
+        return "its slabs run past the end of its entries";
+    for (size_t i = 0; i < n_entries; i++) {
+        uint32_t edge = index->entries[2 * i], label = index->entries[2 * i + 1];
+        if (edge >= n_edges)
+            return "an entry refers to an edge it doesn't have";
+        if (label != NOLABEL && label >= index->ids.size())
+            return "an entry refers to a feature it doesn't have";
+    }
+
+    index->edges.resize(edges.size() / 4);
+    for (size_t i = 0; i < index->edges.size(); i++) {
+        index->edges[i].lo.x = edges[4 * i];
+        index->edges[i].lo.y = edges[4 * i + 1];
+        index->edges[i].hi.x = edges[4 * i + 2];
+        index->edges[i].hi.y = edges[4 * i + 3];
+        index->edges[i].owner = -1;
+    }
+    return NULL;
+}
+
+int locate_point(const location_index_t &index, double x, double y) {
+    /* Return the position in index.ids of the feature containing (x, y), or
+     * -1 if there isn't one. Points on a slab boundary belong to the slab
+     * above, and points on an edge to the feature on its right. */
+    if (index.stops.size() < 2 || y < index.stops.front() || y >= index.stops.back())
+        return -1;
+    size_t slab = std::upper_bound(index.stops.begin(), index.stops.end(), y)
+                  - index.stops.begin() - 1;
+    uint32_t lo = index.offsets[slab], hi = index.offsets[slab + 1];
+
+    /* Find the last edge at or to the left of the point. */
+    if (lo == hi || x < x_at(index_edge(index, index.entries[2 * lo]), y))
+        return -1;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (x_at(index_edge(index, index.entries[2 * mid]), y) <= x)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    uint32_t label = index.entries[2 * lo + 1];
+    return (label == NOLABEL ? -1 : (int) label);
+}
+
+int query_location_index(const char *filename) {
+    /* Answer point lookups against a location index: read "x y" (or "x,y")
+     * lines from stdin, and write the ID of the feature containing each
+     * point to stdout, or an empty line if there isn't one. */
+    location_index_t index;
+    const char *error = read_location_index(filename, &index);
+    if (error != NULL) {
+        std::cerr << "Reading location index " << filename << " failed: "
+                  << error << ".\n";
+        return 1;
+    }
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::replace(line.begin(), line.end(), ',', ' ');
+        double x, y;
+        if (sscanf(line.c_str(), "%lf %lf", &x, &y) != 2) {
+            std::cout << "\n";
+            continue;
+        }
+        int found = locate_point(index, x, y);
+        if (found >= 0) std::cout << index.ids[found];
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+/* Piece adjacency. With -adjacency, a CSV side table lists every pair of
+ * pieces that share some of their boundary, whether they're pieces of one
+ * feature on either side of a cut, or pieces of neighbouring features, so
+ * that the query side can walk from a piece to its neighbours without
+ * probing the index. Pieces are numbered by their FIDs in the output layer,
+ * so that pieces deleted again after a feature failed don't throw the
+ * numbers of the rest off.
+ *
+ * Neighbouring pieces needn't have been cut at the same places, so their
+ * shared edges don't have to match up end to end. Instead, every edge goes
+ * in the cells of a grid that it passes near, and two edges in the same
+ * cell are shared if they're collinear and overlap, to within
+ * ADJACENCYTOLERANCE of the size of the layer. */
+#define ADJACENCYTOLERANCE 1e-9
+
+typedef struct {
+    std::vector<std::pair<int, feature_id_t> > pieces;  // FID, feature ID
+    std::vector<segment_t> edges;                       // owner is the piece
+    OGREnvelope extent;
+} adjacency_t;
+
+void add_piece_edges(adjacency_t *adjacency, OGRPolygon *piece, int fid,
+                     feature_id_t id) {
+    /* Keep the edges of a piece that's about to be written with this FID,
+     * which can be set afterwards, once it's known. */
+    ring_list_t rings;
+    polygon_to_rings(piece, &rings);
+    if (rings.empty()) return;
+    OGREnvelope envelope;
+    ring_envelope(rings[0], &envelope);
+    if (adjacency->pieces.empty()) adjacency->extent = envelope;
+    else adjacency->extent.Merge(envelope);
+
+    int owner = adjacency->pieces.size();
+    adjacency->pieces.push_back(std::make_pair(fid, id));
+    for (size_t r = 0; r < rings.size(); r++) {
+        const ring_t &ring = rings[r];
+        for (size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++) {
+            if (ring[i].x == ring[j].x && ring[i].y == ring[j].y) continue;
+            segment_t s;
+            s.lo = ring[j];
+            s.hi = ring[i];
+            s.owner = owner;
+            adjacency->edges.push_back(s);
+        }
+    }
+}
+
+void forget_pieces(adjacency_t *adjacency, size_t pieces) {
+    /* Drop the pieces after the first few, which weren't written after all. */
+    adjacency->pieces.resize(pieces);
+    while (!adjacency->edges.empty() && adjacency->edges.back().owner >= (int) pieces)
+        adjacency->edges.pop_back();
+}
+
+static inline double edge_length(const segment_t &e) {
+    return sqrt((e.hi.x - e.lo.x) * (e.hi.x - e.lo.x)
+                + (e.hi.y - e.lo.y) * (e.hi.y - e.lo.y));
+}
+
+static bool edges_overlap(const segment_t &a, const segment_t &b, double tolerance) {
+    /* Whether the edges are collinear, and overlap by more than the
+     * tolerance. The shorter one is measured against the longer one. */
+    double la = edge_length(a), lb = edge_length(b);
+    const segment_t &l = (la >= lb ? a : b), &s = (la >= lb ? b : a);
+    double length = std::max(la, lb);
+    if (length <= tolerance) return false;
+    double dx = (l.hi.x - l.lo.x) / length, dy = (l.hi.y - l.lo.y) / length;
+    double x0 = s.lo.x - l.lo.x, y0 = s.lo.y - l.lo.y,
+           x1 = s.hi.x - l.lo.x, y1 = s.hi.y - l.lo.y;
+    if (fabs(x0 * dy - y0 * dx) > tolerance || fabs(x1 * dy - y1 * dx) > tolerance)
+        return false;
+    double t0 = x0 * dx + y0 * dy, t1 = x1 * dx + y1 * dy;
+    return std::min(std::max(t0, t1), length) - std::max(std::min(t0, t1), 0.0) > tolerance;
+}
+
+typedef std::pair<std::pair<int64_t, int64_t>, uint32_t> adjacency_cell_t;
+
+static void edge_cells(const segment_t &e, uint32_t edge, const OGREnvelope &extent,
+                       double cell, double tolerance, std::vector<adjacency_cell_t> *cells) {
+    /* Push the grid cells that any point within the tolerance of the edge
+     * could be in. A short edge just takes the cells its bounding box
+     * covers. A long one is sampled every half a cell, and takes the cells
+     * around each sample, which is enough for any edge overlapping it to
+     * share one of them. */
+    int64_t x0 = (int64_t) floor((std::min(e.lo.x, e.hi.x) - tolerance - extent.MinX) / cell),
+            x1 = (int64_t) floor((std::max(e.lo.x, e.hi.x) + tolerance - extent.MinX) / cell),
+            y0 = (int64_t) floor((std::min(e.lo.y, e.hi.y) - tolerance - extent.MinY) / cell),
+            y1 = (int64_t) floor((std::max(e.lo.y, e.hi.y) + tolerance - extent.MinY) / cell);
+    if ((x1 - x0 + 1) * (y1 - y0 + 1) <= 9) {
+        for (int64_t x = x0; x <= x1; x++)
+            for (int64_t y = y0; y <= y1; y++)
+                cells->push_back(std::make_pair(std::make_pair(x, y), edge));
+        return;
+    }
+    std::set<std::pair<int64_t, int64_t> > near;
+    int samples = (int) ceil(2 * edge_length(e) / cell);
+    for (int i = 0; i <= samples; i++) {
+        double t = (double) i / samples;
+        int64_t x = (int64_t) floor((e.lo.x + t * (e.hi.x - e.lo.x) - extent.MinX) / cell),
+                y = (int64_t) floor((e.lo.y + t * (e.hi.y - e.lo.y) - extent.MinY) / cell);
+        for (int64_t dx = -1; dx <= 1; dx++)
+            for (int64_t dy = -1; dy <= 1; dy++)
+                near.insert(std::make_pair(x + dx, y + dy));
+    }
+    for (std::set<std::pair<int64_t, int64_t> >::iterator it = near.begin();
+         it != near.end(); it++)
+        cells->push_back(std::make_pair(*it, edge));
+}
+
+void find_adjacent_pieces(const adjacency_t &adjacency,
+                          std::vector<std::pair<uint32_t, uint32_t> > *pairs) {
+    /* Find every pair of pieces that share an edge, or part of one, as
+     * pairs of indexes into adjacency.pieces, lower first. */
+    const std::vector<segment_t> &edges = adjacency.edges;
+    if (edges.empty()) return;
+    const OGREnvelope &extent = adjacency.extent;
+    double size = std::max(extent.MaxX - extent.MinX, extent.MaxY - extent.MinY),
+           tolerance = size * ADJACENCYTOLERANCE, total = 0;
+    for (size_t i = 0; i < edges.size(); i++)
+        total += edge_length(edges[i]);
+    double cell = std::max(total / edges.size(), tolerance * 1000);
+    if (cell <= 0) return;
+
+    /* Sort the edges into their cells, and compare the edges of different
+     * pieces that share one. */
+    std::vector<adjacency_cell_t> cells;
+    for (size_t i = 0; i < edges.size(); i++)
+        edge_cells(edges[i], i, extent, cell, tolerance, &cells);
+    std::sort(cells.begin(), cells.end());
+    for (size_t start = 0, end; start < cells.size(); start = end) {
+        for (end = start + 1; end < cells.size()
+                              && cells[end].first == cells[start].first; end++);
+        for (size_t i = start; i < end; i++) {
+            const segment_t &a = edges[cells[i].second];
+            for (size_t j = i + 1; j < end; j++) {
+                const segment_t &b = edges[cells[j].second];
+                if (a.owner == b.owner || !edges_overlap(a, b, tolerance)) continue;
+                pairs->push_back(std::make_pair(std::min(a.owner, b.owner),
+                                                std::max(a.owner, b.owner)));
+            }
+        }
+    }
+    std::sort(pairs->begin(), pairs->end());
+    pairs->erase(std::unique(pairs->begin(), pairs->end()), pairs->end());
+}
+
+bool write_adjacency(const char *filename, const adjacency_t &adjacency,
+                     size_t *written) {
+    /* Write the side table, as CSV, with the FID and feature ID of each
+     * piece of each pair. Returns false if it couldn't be written. */
+    std::vector<std::pair<uint32_t, uint32_t> > pairs;
+    find_adjacent_pieces(adjacency, &pairs);
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) return false;
+    fputs("piece,id,neighbour,neighbour_id\n", file);
+    for (size_t i = 0; i < pairs.size(); i++) {
+        const std::pair<int, feature_id_t> &a = adjacency.pieces[pairs[i].first],
+                                            &b = adjacency.pieces[pairs[i].second];
+        fprintf(file, "%d,%d,%d,%d\n", a.first, a.second, b.first, b.second);
+    }
+    *written = pairs.size();
+    return fclose(file) == 0;
+}
+
+OGRDataSource *create_destination(const char* drivername, const char* filename,
+        const char *layername, OGRSpatialReference *srs,
+        const char *id_field_name, bool convex, bool kinds, bool attributes) {
+
+    /* Find the requested OGR output driver. */
+    OGRSFDriver* driver;
+    driver = OGRSFDriverRegistrar::GetRegistrar()->GetDriverByName(drivername);
+    if( driver == NULL ) {
+        std::cerr << drivername << " driver not available.\n";
+        return NULL;
+    }
+
+    /* Create the output data source. */
+    OGRDataSource* ds = driver->CreateDataSource( filename, NULL );
+    if( ds == NULL ) {
+        std::cerr << "Creation of output file " << filename << " failed.\n";
+        return NULL;
+    }
+
+    /* Create the output layer. A Shapefile would otherwise be repacked when
+     * it's closed, if any pieces had to be deleted, which would renumber the
+     * FIDs that the adjacency table refers to. */
+    char **layer_options = NULL;
+#if GDAL_VERSION_MAJOR > 2 || (GDAL_VERSION_MAJOR == 2 && GDAL_VERSION_MINOR >= 2)
+    if (strcmp(drivername, "ESRI Shapefile") == 0)
+        layer_options = CSLSetNameValue(layer_options, "AUTO_REPACK", "NO");
+#endif
+    OGRLayer* layer;
+    layer = ds->CreateLayer( layername, srs, OUTPUTTYPE, layer_options );
+    CSLDestroy(layer_options);
+    if( layer == NULL ) {
+        std::cerr << "Layer creation failed.\n";
+        return NULL;
+    }
+
+    /* Add the ID field, which defaults to "id" if a name isn't given. */
+    if (id_field_name == NULL) id_field_name = IDFIELD;
+    OGRFieldDefn field( id_field_name, OFTInteger );
+    if( layer->CreateField( &field ) != OGRERR_NONE ) {
+        std::cerr <<  "Creating " << id_field_name << " field failed.\n";
+        return NULL;
+    }
+
+    /* Flag the pieces as convex, if they all are, so that the query side
+     * knows it can use a logarithmic point in polygon test. */
+    if (convex) {
+        OGRFieldDefn convex_field( CONVEXFIELD, OFTInteger );
+        if( layer->CreateField( &convex_field ) != OGRERR_NONE ) {
+            std::cerr <<  "Creating " << CONVEXFIELD << " field failed.\n";
+            return NULL;
+        }
+    }
+
+    /* Say which polygons are pieces and which are approximations, if
+     * there are approximations. */
+    if (kinds) {
+        OGRFieldDefn kind_field( KINDFIELD, OFTInteger );
+        if( layer->CreateField( &kind_field ) != OGRERR_NONE ) {
+            std::cerr <<  "Creating " << KINDFIELD << " field failed.\n";
+            return NULL;
+        }
+    }
+
+    /* Describe each polygon in attributes, if asked to, so that queries
+     * can filter on them without looking at the geometry. */
+    if (attributes) {
+        static const char *const names[] = { MINXFIELD, MINYFIELD, MAXXFIELD, MAXYFIELD,
+                                             AREAFIELD, VERTICESFIELD, HOLESFIELD,
+                                             DEPTHFIELD };
+        for (int i = 0; i < 8; i++) {
+            OGRFieldDefn attribute_field( names[i], i < 5 ? OFTReal : OFTInteger );
+            if( layer->CreateField( &attribute_field ) != OGRERR_NONE ) {
+                std::cerr <<  "Creating " << names[i] << " field failed.\n";
+                return NULL;
+            }
+        }
+    }
+    return ds;
+}
+
+bool write_feature(OGRLayer *layer, OGRPolygon *geom, feature_id_t id,
+                   piece_kind_t kind, int depth, GIntBig *fid) {
+    /* Create a new feature from the geometry and ID, and write it to the
+     * output layer. If the layer has a convex field, every piece is, and
+     * the approximations are too. If it has the attribute fields, they're
+     * filled in from the geometry, apart from the depth, which is left
+     * empty if it's -1. The new feature's FID is stored in fid, if given.
+     * Returns false if OGR couldn't write it. */
+    OGRFeature *feature = OGRFeature::CreateFeature( layer->GetLayerDefn() );
+    feature->SetField(0, id);
+    int convex_field = feature->GetFieldIndex(CONVEXFIELD),
+        kind_field = feature->GetFieldIndex(KINDFIELD),
+        depth_field = feature->GetFieldIndex(DEPTHFIELD);
+    if (convex_field >= 0)
+        feature->SetField(convex_field, 1);
+    if (kind_field >= 0)
+        feature->SetField(kind_field, (int) kind);
+    if (depth_field >= 0) {
+        OGREnvelope envelope;
+        geom->getEnvelope(&envelope);
+        int vertices = geom->getExteriorRing()->getNumPoints();
+        for (int i = 0; i < geom->getNumInteriorRings(); i++)
+            vertices += geom->getInteriorRing(i)->getNumPoints();
+        feature->SetField(MINXFIELD, envelope.MinX);
+        feature->SetField(MINYFIELD, envelope.MinY);
+        feature->SetField(MAXXFIELD, envelope.MaxX);
+        feature->SetField(MAXYFIELD, envelope.MaxY);
+        feature->SetField(AREAFIELD, geom->get_Area());
+        feature->SetField(VERTICESFIELD, vertices);
+        feature->SetField(HOLESFIELD, geom->getNumInteriorRings());
+        if (depth >= 0)
+            feature->SetField(depth_field, depth);
+    }
+    feature->SetGeometryDirectly(geom); // saves having to destroy it manually
+    bool ok = (layer->CreateFeature( feature ) == OGRERR_NONE);
+    if (ok && fid != NULL)
+        *fid = feature->GetFID();
+    OGRFeature::DestroyFeature( feature );
+    return ok;
+}
+
+void delete_pieces(OGRPolyList *pieces) {
+    for (OGRPolyList::iterator it = pieces->begin(); it != pieces->end(); it++)
+        delete *it;
+    pieces->clear();
+}
+
+bool write_pieces(OGRLayer *layer, OGRPolyList *pieces, feature_id_t id,
+                  piece_kind_t kind, const std::vector<int> *depths, int *written,
+                  adjacency_t *adjacency, std::vector<GIntBig> *fids) {
+    /* Write each of the pieces with write_feature(), adding to the written
+     * count and the fids, and stopping at the first one that fails; the
+     * rest are just destroyed. The depths, if given, go with the pieces one
+     * for one. Each piece's edges are kept in the adjacency, if there is
+     * one, under its FID, so long as it was written. Returns false if any
+     * failed. */
+    bool ok = true;
+    if (depths != NULL && depths->size() != pieces->size())
+        depths = NULL;
+    for (OGRPolyList::iterator it = pieces->begin(); it != pieces->end(); it++) {
+        size_t kept = (adjacency ? adjacency->pieces.size() : 0);
+        int depth = (depths ? (*depths)[it - pieces->begin()] : -1);
+        GIntBig fid;
+        if (ok && adjacency != NULL)
+            add_piece_edges(adjacency, *it, -1, id);
+        if (ok && write_feature(layer, *it, id, kind, depth, &fid)) {
+            (*written)++;
+            if (fids != NULL) fids->push_back(fid);
+            if (adjacency != NULL && adjacency->pieces.size() > kept)
+                adjacency->pieces.back().first = (int) fid;
+        } else if (ok) {
+            ok = false;
+            if (adjacency != NULL) forget_pieces(adjacency, kept);
+        }
+        else
+            delete *it;
+    }
+    pieces->clear();
+    return ok;
+}
+
+void unwrite_pieces(OGRLayer *layer, feature_id_t id, const std::vector<GIntBig> &fids,
+                    int *written) {
+    /* Delete the pieces of a feature that failed after some of them were
+     * written, taking them off the written count, so that none of it is
+     * left in the output. Not every driver can delete features; if this one
+     * can't, the pieces stay, and we say so. */
+    size_t kept = 0;
+    for (size_t i = fids.size(); i-- > 0; ) {
+        if (layer->DeleteFeature(fids[i]) == OGRERR_NONE)
+            (*written)--;
+        else
+            kept++;
+    }
+    if (kept > 0)
+        std::cerr << "WARNING: feature " << id << ": " << kept << " pieces already "
+                  << "written couldn't be taken out of the output\n";
+}
+
+FILE *open_quarantine(const char *filename) {
+    /* Start a quarantine file, where features that couldn't be processed
+     * are written as CSV, with their ID, what went wrong, and their
+     * geometry as it was read, in a WKT column that OGR's CSV driver
+     * picks up. */
+    FILE *file = fopen(filename, "w");
+    if (file != NULL)
+        fputs("id,error,WKT\n", file);
+    return file;
+}
+
+void quarantine_feature(FILE *file, feature_id_t id, const char *error,
+                        OGRGeometry *geometry) {
+    /* Warn about a feature that couldn't be processed, and add it to the
+     * quarantine file, if there is one. */
+    std::cerr << "WARNING: feature " << id << ": " << error << "\n";
+    if (file == NULL) return;
+
+    char *wkt = NULL;
+    if (geometry != NULL) geometry->exportToWkt(&wkt);
+    fprintf(file, "%d,\"%s\",\"%s\"\n", id, error, wkt ? wkt : "");
+    CPLFree(wkt);
+}
+
+/* Everything that's done to each feature between reading it and writing its
+ * pieces, apart from reprojecting it, is done in a feature job, which can run
+ * on a worker thread. OGR only calls GEOS in a thread-safe way from GDAL 2.0
+ * on, so with anything older, jobs always run on the main thread. */
+#if GDAL_VERSION_MAJOR >= 2
+#define WORKER_THREADS 1
+#endif
+
+/* Relative difference in area, or area of overlap, that --verify lets pass
+ * as rounding error. */
+#define VERIFYTOLERANCE 1e-6
+
+/* A rough guess at how much memory a feature job needs for each vertex of
+ * its geometry: the geometry itself, the copy kept for the quarantine, the
+ * pieces, and GEOS's own copies of each polygon it intersects, all the way
+ * down the recursion. It errs on the high side. */
+#define BYTESPERVERTEX 512
+
+/* How each feature should be processed. */
+typedef struct {
+    split_limits_t limits;
+    split_mode_t mode;
+    double tolerance;
+    bool geographic, merge, verify;
+    int approx_vertices;
+    size_t spill_vertices;  // features bigger than this are split out of core
+    int min_zoom, max_zoom; // of vector tiles
+    const char *tile_layer; // the name of the layer in them
+    const std::vector<feature_id_t> *tile_ids;  // of the features in them
+} job_options_t;
+
+typedef struct {
+    feature_id_t id;
+    size_t bytes;                   // how much memory it's expected to need
+    OGRGeometry *geometry;          // owned by the job
+    OGRGeometry *original;          // as read, if it might be quarantined
+    OGRPolyList pieces, inner, outer;
+    split_state_t state;
+    std::vector<std::string> problems;  // found by --verify
+} feature_job_t;
+
+size_t geometry_vertices(OGRGeometry *geometry) {
+    /* Count the points in every ring of a (multi)polygon. */
+    if (geometry == NULL) return 0;
+    if (geometry->getGeometryType() == wkbMultiPolygon) {
+        OGRMultiPolygon *multi = (OGRMultiPolygon*) geometry;
+        size_t count = 0;
+        for (int i = 0; i < multi->getNumGeometries(); i++)
+            count += geometry_vertices(multi->getGeometryRef(i));
+        return count;
+    }
+    if (geometry->getGeometryType() != wkbPolygon) return 0;
+    OGRPolygon *polygon = (OGRPolygon*) geometry;
+    size_t count = polygon->getExteriorRing()->getNumPoints();
+    for (int i = 0; i < polygon->getNumInteriorRings(); i++)
+        count += polygon->getInteriorRing(i)->getNumPoints();
+    return count;
+}
+
+const char *prepare_geometry(OGRGeometry **geometry, const job_options_t &options) {
+    /* Prune the geometry's vertices, and cut it at the antimeridian if need
+     * be, which replaces it with a new one. Returns an error message if it
+     * couldn't be cut, or NULL. In coverage mode, only repeated vertices are
+     * dropped here, and collinear ones are left to prune_coverage(). */
+    const char *error = NULL;
+    prune_vertices(*geometry, options.mode == SPLIT_COVERAGE ? -1 : options.tolerance);
+    if (options.geographic) {
+        OGRGeometry *cut = cut_antimeridian(*geometry, &error);
+        if (cut != NULL) {
+            delete *geometry;
+            *geometry = cut;
+        }
+    }
+    return error;
+}
+
+double geometry_area(const OGRGeometry *geometry) {
+    /* The area of any geometry; zero for points and lines. */
+    if (geometry == NULL) return 0;
+    switch (geometry->getGeometryType()) {
+        case wkbPolygon:
+            return ((const OGRPolygon*) geometry)->get_Area();
+        case wkbMultiPolygon:
+        case wkbGeometryCollection:
+            return ((const OGRGeometryCollection*) geometry)->get_Area();
+        default:
+            return 0;
+    }
+}
+
+static bool envelope_min_x_less(const std::pair<OGREnvelope, size_t> &a,
+                                const std::pair<OGREnvelope, size_t> &b) {
+    return a.first.MinX < b.first.MinX;
+}
+
+void verify_pieces(OGRGeometry *geometry, const OGRPolyList &pieces,
+                   const job_options_t &options, std::vector<std::string> *problems) {
+    /* Check that the pieces tile the geometry: that their areas add up to
+     * its area, that no two of them overlap, and that each one is within
+     * the vertex limit. Anything wrong gets described in problems. Only
+     * pieces whose bounding boxes overlap are compared with each other,
+     * found by sweeping across them from left to right. */
+    char message[200];
+    double area = geometry_area(geometry), total = 0;
+    if (geometry != NULL && !geometry->IsValid()) {
+        /* split_polygons() will have tidied it up first. */
+        OGRGeometry *tidy = geometry->Buffer(0);
+        area = geometry_area(tidy);
+        delete tidy;
+    }
+
+    std::vector<std::pair<OGREnvelope, size_t> > boxes(pieces.size());
+    std::vector<double> areas(pieces.size());
+    int too_big = 0, overlaps = 0;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        pieces[i]->getEnvelope(&boxes[i].first);
+        boxes[i].second = i;
+        areas[i] = pieces[i]->get_Area();
+        total += areas[i];
+        if (options.mode != SPLIT_TRAPEZOIDS
+                && pieces[i]->getExteriorRing()->getNumPoints() > options.limits.max_vertices)
+            too_big++;
+    }
+
+    if (fabs(total - area) > VERIFYTOLERANCE * area) {
+        snprintf(message, sizeof(message), "piece areas add up to %.17g, not %.17g", total, area);
+        problems->push_back(message);
+    }
+    if (too_big > 0) {
+        snprintf(message, sizeof(message), "%d pieces have more than %d vertices",
+                 too_big, options.limits.max_vertices);
+        problems->push_back(message);
+    }
+
+    std::sort(boxes.begin(), boxes.end(), envelope_min_x_less);
+    for (size_t i = 0; i < boxes.size(); i++) {
+        const OGREnvelope &a = boxes[i].first;
+        for (size_t j = i + 1; j < boxes.size() && boxes[j].first.MinX < a.MaxX; j++) {
+            const OGREnvelope &b = boxes[j].first;
+            if (b.MinY >= a.MaxY || b.MaxY <= a.MinY) continue;
+            size_t p = boxes[i].second, q = boxes[j].second;
+            OGRGeometry *both = pieces[p]->Intersection(pieces[q]);
+            if (geometry_area(both) > VERIFYTOLERANCE * std::min(areas[p], areas[q]))
+                overlaps++;
+            delete both;
+        }
+    }
+    if (overlaps > 0) {
+        snprintf(message, sizeof(message), "%d pairs of pieces overlap", overlaps);
+        problems->push_back(message);
+    }
+}
+
+void verify_approximations(OGRGeometry *geometry, const OGRPolyList &inner,
+                           std::vector<std::string> *problems) {
+    /* Check that the inner approximations are inside the geometry. */
+    int outside = 0;
+    for (size_t i = 0; i < inner.size(); i++)
+        if (!geometry->Contains(inner[i]))
+            outside++;
+    if (outside > 0) {
+        char message[100];
+        snprintf(message, sizeof(message), "%d inner approximations aren't inside it", outside);
+        problems->push_back(message);
+    }
+}
+
+void split_geometry(OGRPolyList *pieces, OGRGeometry *geometry,
+                    const job_options_t &options, split_state_t *state) {
+    /* Split the geometry however the options say, starting the state
+     * afresh, with the whole of the limits' time and node budget for the
+     * feature. Only split_polygons() knows the depths of the pieces; in the
+     * other modes, whatever depths the parts they were made from had are
+     * replaced with -1 for each piece. */
+    const split_limits_t &limits = options.limits;
+    state->deadline = (limits.max_seconds > 0 ? wallclock() + limits.max_seconds : 0);
+    state->nodes = (limits.max_nodes > 0 ? limits.max_nodes : -1);
+    state->exceeded = false;
+    state->error = NULL;
+    state->depths.clear();
+    state->clipped[CLIP_GEOS] = state->clipped[CLIP_RECT] = 0;
+    state->clip_seconds[CLIP_GEOS] = state->clip_seconds[CLIP_RECT] = 0;
+    if (options.mode == SPLIT_TRIANGLES)
+        triangulate_polygons(pieces, geometry, options.limits, state);
+    else if (options.mode == SPLIT_CONVEX)
+        convex_polygons(pieces, geometry, options.limits, state);
+    else if (options.mode == SPLIT_TRAPEZOIDS)
+        trapezoid_polygons(pieces, geometry, state);
+    else {
+        split_within_budget(pieces, geometry, options.limits, state);
+        return;
+    }
+    state->depths.assign(pieces->size(), -1);
+}
+
+void process_feature(feature_job_t *job, const job_options_t &options) {
+    /* Split the job's geometry, verify the pieces, and make the
+     * approximations, as the options say. */
+    const char *error = prepare_geometry(&job->geometry, options);
+    if (error != NULL) {
+        job->state.error = error;
+        return;
+    }
+    split_geometry(&job->pieces, job->geometry, options, &job->state);
+    if (options.merge && options.mode == SPLIT_QUADRANTS && !job->state.exceeded)
+        merge_pieces(&job->pieces, &job->state.depths, options.limits);
+    if (job->state.error != NULL)
+        return;
+
+    if (options.verify)
+        verify_pieces(job->geometry, job->pieces, options, &job->problems);
+    if (options.approx_vertices > 0) {
+        approximate_polygons(&job->inner, &job->outer, job->geometry,
+                             options.limits, options.approx_vertices, &job->state);
+        if (options.verify)
+            verify_approximations(job->geometry, job->inner, &job->problems);
+    }
+}
+
+template <class Job>
+class WorkerPool {
+    /* Runs jobs on a number of worker threads, and hands them back to the
+     * main thread in whatever order they finish, to be written out. Each
+     * job is run by passing it to the process function, and says how many
+     * bytes it needs in its bytes member. With no threads, each job is just
+     * run when it's submitted. The main thread should keep submitting jobs
+     * until the pool is full(), and then take finished() ones until it
+     * isn't.
+     *
+     * If there's a memory budget, the pool also counts as full when the
+     * next job wouldn't fit in what the jobs already in flight leave of it,
+     * so big features are held back until others are done. A job that's too
+     * big for the whole budget still gets in once the pool is empty. */
+public:
+    typedef void (*process_t)(Job *job, const job_options_t &options);
+
+    WorkerPool(int threads, size_t budget, process_t process,
+               const job_options_t &options)
+            : process_(process), options_(options), budget_(budget),
+              in_flight_(0), bytes_(0),
+              held_back_(0), holding_(false), stopping_(false) {
+        capacity_ = (threads > 0 ? 2 * threads : 1);
+#ifdef WORKER_THREADS
+        mutex_ = CPLCreateMutex();  // which also locks it
+        CPLReleaseMutex(mutex_);
+        work_ = CPLCreateCond();
+        done_ = CPLCreateCond();
+        for (int i = 0; i < threads; i++)
+            threads_.push_back(CPLCreateJoinableThread(worker, this));
+#endif
+    }
+
+    ~WorkerPool() {
+#ifdef WORKER_THREADS
+        CPLAcquireMutex(mutex_, 1000.0);
+        stopping_ = true;
+        CPLCondBroadcast(work_);
+        CPLReleaseMutex(mutex_);
+        for (size_t i = 0; i < threads_.size(); i++)
+            CPLJoinThread(threads_[i]);
+        CPLDestroyCond(work_);
+        CPLDestroyCond(done_);
+        CPLDestroyMutex(mutex_);
+#endif
+    }
+
+    bool full(size_t bytes) {
+        /* Is there no room for a job that needs this many bytes? The
+         * caller keeps asking about the same job until there is, so it's
+         * only counted as held back the first time. */
+        lock();
+        bool full = (in_flight_ >= capacity_);
+        if (!full && in_flight_ > 0 && budget_ > 0 && bytes_ + bytes > budget_) {
+            full = true;
+            if (!holding_) held_back_++;
+            holding_ = true;
+        }
+        if (!full) holding_ = false;
+        unlock();
+        return full;
+    }
+
+    size_t held_back() const {
+        /* How many jobs had to wait for memory. */
+        return held_back_;
+    }
+
+    void submit(Job *job) {
+        lock();
+        in_flight_++;
+        bytes_ += job->bytes;
+#ifdef WORKER_THREADS
+        if (!threads_.empty()) {
+            queue_.push_back(job);
+            CPLCondSignal(work_);
+            unlock();
+            return;
+        }
+#endif
+        unlock();
+        process_(job, options_);
+        lock();
+        finished_.push_back(job);
+        unlock();
+    }
+
+    Job *finished() {
+        /* Take the next finished job, waiting for one if need be. Returns
+         * NULL once there are none left to wait for. */
+        lock();
+#ifdef WORKER_THREADS
+        while (finished_.empty() && in_flight_ > 0)
+            CPLCondWait(done_, mutex_);
+#endif
+        Job *job = NULL;
+        if (!finished_.empty()) {
+            job = finished_.front();
+            finished_.pop_front();
+            in_flight_--;
+            bytes_ -= job->bytes;
+        }
+        unlock();
+        return job;
+    }
+
+private:
+#ifdef WORKER_THREADS
+    void lock() { CPLAcquireMutex(mutex_, 1000.0); }
+    void unlock() { CPLReleaseMutex(mutex_); }
+
+    static void worker(void *arg) {
+        WorkerPool *pool = (WorkerPool*) arg;
+        pool->lock();
+        for (;;) {
+            while (pool->queue_.empty() && !pool->stopping_)
+                CPLCondWait(pool->work_, pool->mutex_);
+            if (pool->queue_.empty()) break;
+            Job *job = pool->queue_.front();
+            pool->queue_.pop_front();
+            pool->unlock();
+            pool->process_(job, pool->options_);
+            pool->lock();
+            pool->finished_.push_back(job);
+            CPLCondSignal(pool->done_);
+        }
+        pool->unlock();
+    }
+
+    CPLMutex *mutex_;
+    CPLCond *work_, *done_;
+    std::vector<CPLJoinableThread*> threads_;
+#else
+    void lock() {}
+    void unlock() {}
+#endif
+    process_t process_;
+    const job_options_t &options_;
+    std::deque<Job*> queue_, finished_;
+    size_t capacity_, budget_, in_flight_, bytes_, held_back_;
+    bool holding_;      // the job being asked about was held back
+    bool stopping_;
+};
+
+/* Out of core splitting, for features so big that splitting them the usual
+ * way, with all of GEOS's copies of them, doesn't fit in memory. The
+ * feature's edges are sorted into a grid of buckets in a temporary file, and
+ * the geometry is freed; then each bucket is read back on its own, clipped
+ * to its rectangle with RectClipper, and split as usual. Only one bucket's
+ * worth of the feature is ever in memory after that. */
+#define SPILLBLOCK 128      // edges written to the spill file at a time
+#define MAXBUCKETS 64       // buckets along each side of the grid
+
+typedef struct {
+    uint32_t ring;          // which ring of the feature it's from
+    uint32_t whole;         // nonzero if the ring is entirely in this bucket
+    point_t a, b;
+} spill_edge_t;
+
+class SpillFile {
+    /* A temporary file of edges sorted into buckets. Each bucket's edges are
+     * kept in memory until there are SPILLBLOCK of them, and then written
+     * out as a block, so the file has blocks from every bucket mixed up,
+     * and each bucket keeps a list of where its own blocks are. */
+public:
+    SpillFile(size_t buckets)
+        : file_(tmpfile()), ok_(file_ != NULL), buffers_(buckets), blocks_(buckets) {}
+
+    ~SpillFile() {
+        if (file_ != NULL) fclose(file_);
+    }
+
+    bool ok() const { return ok_; }
+
+    void add(size_t bucket, const spill_edge_t &edge) {
+        buffers_[bucket].push_back(edge);
+        if (buffers_[bucket].size() == SPILLBLOCK) flush(bucket);
+    }
+
+    bool read(size_t bucket, std::vector<spill_edge_t> *edges) {
+        /* Get all the edges in a bucket, in the order they were added. */
+        edges->clear();
+        for (size_t i = 0; ok_ && i < blocks_[bucket].size(); i++) {
+            size_t start = edges->size(), count = blocks_[bucket][i].second;
+            edges->resize(start + count);
+            ok_ = (fseeko(file_, blocks_[bucket][i].first, SEEK_SET) == 0
+                   && fread(&(*edges)[start], sizeof(spill_edge_t), count, file_) == count);
+        }
+        edges->insert(edges->end(), buffers_[bucket].begin(), buffers_[bucket].end());
+        std::vector<spill_edge_t>().swap(buffers_[bucket]);
+        return ok_;
+    }
+
+private:
+    void flush(size_t bucket) {
+        std::vector<spill_edge_t> &buffer = buffers_[bucket];
+        off_t offset = -1;
+        if (ok_)
+            ok_ = (fseeko(file_, 0, SEEK_END) == 0 && (offset = ftello(file_)) >= 0
+                   && fwrite(&buffer[0], sizeof(spill_edge_t), buffer.size(), file_)
+                      == buffer.size());
+        if (ok_)
+            blocks_[bucket].push_back(std::make_pair(offset, buffer.size()));
+        buffer.clear();
+    }
 
-void split_polygons(OGRPolyList *pieces, OGRGeometry* geometry, int max_vertices) {
-    /* split_polygons recursively splits the (multi)polygon into smaller
-     * polygons until each polygon has at most max_vertices, and pushes each
-     * one onto the pieces vector.
-     * 
-     * Multipolygons are automatically divided into their constituent polygons.
-     * Empty polygons and other geometry types are ignored. Invalid polygons
-     * get cleaned up to the best of our ability, but this does trigger
-     * warnings from inside GEOS.
-     *
-     * Each polygon is split by dividing its bounding box into quadrants, and
-     * then recursing on the intersection of each quadrant with the original
-     * polygon, until the pieces are of the desired complexity.
-     */
+    FILE *file_;
+    bool ok_;
+    std::vector<std::vector<spill_edge_t> > buffers_;
+    std::vector<std::vector<std::pair<off_t, size_t> > > blocks_;
+};
 
-    if (geometry == NULL) {
-        std::cerr << "WARNING: NULL geometry passed to split_polygons!\n";
-        return;
+static double grid_line(double min, double max, int size, int i) {
+    /* Where the i'th of the grid lines across one axis is; the first and
+     * last are exactly on the extent. */
+    return (i == size ? max : min + (max - min) * i / size);
+}
+
+static void bucket_span(double lo, double hi, double min, double max, int size,
+                        int *first, int *last) {
+    /* Find the first and last buckets along one axis that the span from lo
+     * to hi touches, boundaries included. */
+    int f = (int) floor((lo - min) / (max - min) * size),
+        l = (int) floor((hi - min) / (max - min) * size);
+    f = std::max(0, std::min(size - 1, f));
+    l = std::max(0, std::min(size - 1, l));
+    while (f > 0 && grid_line(min, max, size, f) >= lo) f--;
+    while (f < size - 1 && grid_line(min, max, size, f + 1) < lo) f++;
+    while (l < size - 1 && grid_line(min, max, size, l + 1) <= hi) l++;
+    while (l > 0 && grid_line(min, max, size, l) > hi) l--;
+    *first = f;
+    *last = l;
+}
+
+static int whole_bucket(double lo, double hi, double min, double max, int size) {
+    /* Which bucket along one axis the span from lo to hi is entirely
+     * inside, or -1 if it isn't inside any one of them. */
+    int first, last;
+    bucket_span(lo, hi, min, max, size, &first, &last);
+    for (int i = first; i <= last; i++)
+        if (grid_line(min, max, size, i) <= lo && hi <= grid_line(min, max, size, i + 1))
+            return i;
+    return -1;
+}
+
+const char *split_out_of_core(OGRLayer *layer, feature_id_t id, OGRGeometry *geometry,
+                              const job_options_t &options, int *written,
+                              adjacency_t *adjacency, std::vector<GIntBig> *fids,
+                              bool *exceeded) {
+    /* Split an enormous (multi)polygon a bucket at a time, as above, and
+     * write the pieces to the layer as it goes, adding to the written count,
+     * the fids, and the adjacency, if there is one.
+     * The geometry is deleted as soon as it's been spilled. Sets exceeded if
+     * any bucket went over the time or step limit. Returns what went wrong,
+     * or NULL if nothing did. */
+    OGREnvelope extent;
+    geometry->getEnvelope(&extent);
+    if (!(extent.MaxX > extent.MinX && extent.MaxY > extent.MinY)) {
+        /* It has no area, so it has no pieces. */
+        delete geometry;
+        return NULL;
     }
-    
-    if (geometry->IsEmpty())
-        return;
-    
+    size_t vertices = geometry_vertices(geometry);
+    int size = (int) ceil(2.0 * vertices / options.spill_vertices);
+    size = std::max(2, std::min(MAXBUCKETS, size));
+
+    /* The rings to spill, and whether each one needs turning around to
+     * run counterclockwise for an exterior, or clockwise for a hole. */
+    std::vector<std::pair<OGRLinearRing*, bool> > rings;
+    std::vector<OGRPolygon*> polygons;
     if (geometry->getGeometryType() == wkbMultiPolygon) {
         OGRMultiPolygon *multi = (OGRMultiPolygon*) geometry;
-        for (int i = 0; i < multi->getNumGeometries(); i++) {
-            split_polygons(pieces, multi->getGeometryRef(i), max_vertices);
+        for (int i = 0; i < multi->getNumGeometries(); i++)
+            if (multi->getGeometryRef(i)->getGeometryType() == wkbPolygon)
+                polygons.push_back((OGRPolygon*) multi->getGeometryRef(i));
+    } else if (geometry->getGeometryType() == wkbPolygon)
+        polygons.push_back((OGRPolygon*) geometry);
+    for (size_t i = 0; i < polygons.size(); i++) {
+        if (polygons[i]->IsEmpty()) continue;
+        OGRLinearRing *exterior = polygons[i]->getExteriorRing();
+        rings.push_back(std::make_pair(exterior, (bool) exterior->isClockwise()));
+        for (int k = 0; k < polygons[i]->getNumInteriorRings(); k++) {
+            OGRLinearRing *hole = polygons[i]->getInteriorRing(k);
+            rings.push_back(std::make_pair(hole, !hole->isClockwise()));
         }
-        return;
-    } 
-    
-    if (geometry->getGeometryType() != wkbPolygon)
-        return;
-    
-    OGRPolygon* polygon = (OGRPolygon*) geometry;
-    if (polygon->getExteriorRing()->getNumPoints() <= max_vertices) {
-        pieces->push_back((OGRPolygon*) polygon->clone());
-        return;
     }
 
-    bool polygonIsPwned = false;
-    if (!polygon->IsValid() || !polygon->IsSimple()) {
-        polygon = (OGRPolygon*) polygon->Buffer(0); // try to tidy it up
-        polygonIsPwned = true; // now we own the reference and have to free it later
+    /* Sort every edge into the buckets it touches. Whether the centre of a
+     * bucket is inside the polygon can't be told from the bucket's own
+     * edges, so every edge that crosses the horizontal line through the
+     * centres of a row of buckets is noted as well. */
+    SpillFile spill((size_t) size * size);
+    std::vector<std::vector<std::pair<double, uint32_t> > > crossings(size);
+    std::vector<int> whole(rings.size(), -1);
+    for (uint32_t k = 0; k < rings.size(); k++) {
+        OGRLinearRing *linear = rings[k].first;
+        OGREnvelope box;
+        linear->getEnvelope(&box);
+        int row = whole_bucket(box.MinY, box.MaxY, extent.MinY, extent.MaxY, size),
+            column = whole_bucket(box.MinX, box.MaxX, extent.MinX, extent.MaxX, size);
+        if (row >= 0 && column >= 0) whole[k] = row * size + column;
+
+        int n = linear->getNumPoints();
+        point_t first = { 0, 0 }, prev = { 0, 0 };
+        int count = 0;
+        for (int j = 0; j <= n; j++) {
+            /* Go round the ring the right way, skipping repeated points,
+             * and finishing with the edge back to the first one. */
+            point_t p;
+            if (j < n) {
+                int i = (rings[k].second ? n - 1 - j : j);
+                p.x = linear->getX(i);
+                p.y = linear->getY(i);
+                if (count > 0 && same_point(p, prev)) continue;
+                if (count == 0) first = p;
+                if (count++ == 0) {
+                    prev = p;
+                    continue;
+                }
+            } else {
+                if (count < 3 || same_point(prev, first)) break;
+                p = first;
+            }
+            const point_t &a = prev, &b = p;
+
+            int r0, r1, c0, c1;
+            bucket_span(std::min(a.y, b.y), std::max(a.y, b.y),
+                        extent.MinY, extent.MaxY, size, &r0, &r1);
+            bucket_span(std::min(a.x, b.x), std::max(a.x, b.x),
+                        extent.MinX, extent.MaxX, size, &c0, &c1);
+            for (int r = r0; r <= r1; r++) {
+                for (int c = c0; c <= c1; c++) {
+                    spill_edge_t edge = { k, whole[k] == r * size + c, a, b };
+                    spill.add(r * size + c, edge);
+                }
+                double centre = (grid_line(extent.MinY, extent.MaxY, size, r)
+                                 + grid_line(extent.MinY, extent.MaxY, size, r + 1)) / 2;
+                if ((a.y > centre) != (b.y > centre))
+                    crossings[r].push_back(std::make_pair(
+                        (b.x - a.x) * (centre - a.y) / (b.y - a.y) + a.x, k));
+            }
+            prev = p;
+        }
     }
+    delete geometry;
+    if (!spill.ok())
+        return "couldn't spill it to disk";
 
-    OGRPoint centroid;
-    polygon->Centroid(&centroid);
-    double cornerX = centroid.getX(),
-           cornerY = centroid.getY();
+    /* Clip and split each bucket in turn. */
+    std::vector<spill_edge_t> edges;
+    for (int r = 0; r < size; r++) {
+        for (int c = 0; c < size; c++) {
+            int bucket = r * size + c;
+            if (!spill.read(bucket, &edges))
+                return "couldn't read it back from disk";
 
-    OGREnvelope envelope;
-    polygon->getEnvelope(&envelope);
+            OGREnvelope rect;
+            rect.MinX = grid_line(extent.MinX, extent.MaxX, size, c);
+            rect.MaxX = grid_line(extent.MinX, extent.MaxX, size, c + 1);
+            rect.MinY = grid_line(extent.MinY, extent.MaxY, size, r);
+            rect.MaxY = grid_line(extent.MinY, extent.MaxY, size, r + 1);
+            double centre = (rect.MinX + rect.MaxX) / 2;
+            bool inside = false;
+            for (size_t i = 0; i < crossings[r].size(); i++)
+                if (crossings[r][i].first > centre && whole[crossings[r][i].second] != bucket)
+                    inside = !inside;
+            if (edges.empty() && !inside) continue;
 
-    for (int quadrant = 0; quadrant < 4; quadrant++) {
-        OGREnvelope bbox(envelope);
-        OGRLinearRing ring;
-        OGRPolygon mask;
-        switch (quadrant) { // in no particular order, actually
-            case 0: bbox.MaxX = cornerX; bbox.MaxY = cornerY; break;
-            case 1: bbox.MaxX = cornerX; bbox.MinY = cornerY; break;
-            case 2: bbox.MinX = cornerX; bbox.MaxY = cornerY; break;
-            case 3: bbox.MinX = cornerX; bbox.MinY = cornerY; break;
-        }
-        ring.setNumPoints(5);
-        ring.setPoint(0, bbox.MinX, bbox.MinY);
-        ring.setPoint(1, bbox.MinX, bbox.MaxY);
-        ring.setPoint(2, bbox.MaxX, bbox.MaxY);
-        ring.setPoint(3, bbox.MaxX, bbox.MinY);
-        ring.setPoint(4, bbox.MinX, bbox.MinY); // close the ring
-        mask.addRing(&ring);
-        OGRGeometry* piece = mask.Intersection(polygon);
-        split_polygons(pieces, piece, max_vertices);
-        delete piece;
-    } 
+            RectClipper clipper(rect);
+            clipper.set_inside(inside);
+            for (size_t i = 0; i < edges.size(); i++) {
+                const spill_edge_t &edge = edges[i];
+                if (i == 0 || edge.ring != edges[i - 1].ring)
+                    clipper.begin_ring();
+                if (edge.whole)
+                    clipper.add_point(edge.a);
+                else
+                    clipper.add_ring_edge(edge.a, edge.b);
+                if (i + 1 == edges.size() || edges[i + 1].ring != edge.ring) {
+                    if (edge.whole) clipper.end_ring();
+                    else clipper.end_partial_ring();
+                }
+            }
+            std::vector<ring_list_t> clipped;
+            clipper.finish(&clipped);
+            std::vector<spill_edge_t>().swap(edges);
 
-    if (polygonIsPwned) delete polygon;
+            for (size_t i = 0; i < clipped.size(); i++) {
+                OGRPolygon *polygon = rings_to_polygon(clipped[i]);
+                OGRPolyList pieces;
+                split_state_t state;
+                split_geometry(&pieces, polygon, options, &state);
+                delete polygon;
+                if (state.exceeded) *exceeded = true;
+                if (state.error != NULL) {
+                    delete_pieces(&pieces);
+                    return state.error;
+                }
+                if (!write_pieces(layer, &pieces, id, KIND_PIECE, NULL, written,
+                                  adjacency, fids))
+                    return "couldn't write a piece to the output";
+            }
+        }
+    }
+    return NULL;
 }
 
-OGRDataSource *create_destination(const char* drivername, const char* filename,
-        const char *layername, const char *id_field_name) {
+/* Vector tiles. With -tiles, every feature is also cut into Mapbox Vector
+ * Tiles for a range of zoom levels, written to a single PMTiles archive.
+ * The tiles are made the way coverage mode splits a layer: the features are
+ * clipped to each tile with RectClipper, and each tile's clipped features
+ * are clipped again for its four children, so nothing is clipped against
+ * the whole feature more than once. Each tile is a job in a WorkerPool.
+ *
+ * The protobuf and PMTiles encodings are simple enough to write directly;
+ * see https://github.com/mapbox/vector-tile-spec and
+ * https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md */
+#define TILEEXTENT 4096     // tile coordinates across a tile
+#define TILEBUFFER 64       // tile coordinates each tile overlaps its neighbours
+#define MAXZOOM 24
+#define DEDUPEBYTES 256     // tiles up to this size are only stored once
+#define MAXROOTBYTES 16384  // for the header and root directory together
 
-    /* Find the requested OGR output driver. */
-    OGRSFDriver* driver;
-    driver = OGRSFDriverRegistrar::GetRegistrar()->GetDriverByName(drivername);
-    if( driver == NULL ) {
-        std::cerr << drivername << " driver not available.\n";
-        return NULL;
+typedef struct {
+    int z, x, y;
+    size_t bytes;                   // for the WorkerPool, which ignores it
+    coverage_t parts;               // clipped to the tile, with its buffer
+    coverage_t children[4];         // clipped to each of its children
+    std::string data;               // the encoded tile, if it has one
+} tile_job_t;
+
+static double tile_latitude(double y) {
+    /* The latitude at y tiles down from the top, at zoom 0. */
+    return atan(sinh(M_PI * (1 - 2 * y))) * 180 / M_PI;
+}
+
+void tile_bounds(int z, int x, int y, OGREnvelope *rect) {
+    /* The longitude and latitude bounds of a tile, including its buffer. */
+    double n = ldexp(1.0, z), buffer = (double) TILEBUFFER / TILEEXTENT;
+    rect->MinX = (x - buffer) / n * 360 - 180;
+    rect->MaxX = (x + 1 + buffer) / n * 360 - 180;
+    rect->MinY = tile_latitude((y + 1 + buffer) / n);
+    rect->MaxY = tile_latitude((y - buffer) / n);
+}
+
+uint64_t tile_id(int z, uint32_t x, uint32_t y) {
+    /* The PMTiles ID of a tile: the number of tiles at lower zooms, plus
+     * its position along a Hilbert curve through the tiles at its own. */
+    uint64_t id = ((((uint64_t) 1) << (2 * z)) - 1) / 3;
+    for (uint32_t s = (z > 0 ? 1u << (z - 1) : 0); s > 0; s >>= 1) {
+        uint32_t rx = (x & s) ? 1 : 0, ry = (y & s) ? 1 : 0;
+        id += (uint64_t) s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - (x & (s - 1));
+                y = s - 1 - (y & (s - 1));
+            }
+            std::swap(x, y);
+        }
     }
+    return id;
+}
 
-    /* Create the output data source. */
-    OGRDataSource* ds = driver->CreateDataSource( filename, NULL );
-    if( ds == NULL ) {
-        std::cerr << "Creation of output file " << filename << " failed.\n";
-        return NULL;
+static void put_varint(std::string *out, uint64_t value) {
+    while (value >= 0x80) {
+        out->push_back((char) ((value & 0x7f) | 0x80));
+        value >>= 7;
     }
+    out->push_back((char) value);
+}
 
-    /* Create the output layer. */
-    OGRLayer* layer;
-    layer = ds->CreateLayer( layername, NULL, OUTPUTTYPE, NULL );
-    if( layer == NULL ) {
-        std::cerr << "Layer creation failed.\n";
-        return NULL;
+static void put_field(std::string *out, int field, const std::string &bytes) {
+    /* A length-delimited protobuf field. */
+    put_varint(out, (field << 3) | 2);
+    put_varint(out, bytes.size());
+    out->append(bytes);
+}
+
+static void put_varint_field(std::string *out, int field, uint64_t value) {
+    put_varint(out, field << 3);
+    put_varint(out, value);
+}
+
+static inline uint32_t zigzag(int32_t n) {
+    return ((uint32_t) n << 1) ^ (uint32_t) (n >> 31);
+}
+
+static bool tile_ring(const ring_t &ring, int z, int x, int y, bool exterior,
+                      std::vector<std::pair<int32_t, int32_t> > *points) {
+    /* Project a ring into tile coordinates, rounding to whole ones, and
+     * dropping any repeated points. Tile coordinates have y going down, so
+     * the ring is turned around too, which leaves exteriors clockwise on
+     * the screen as the spec wants. Returns false if it collapses, or if
+     * rounding flips it over. */
+    double n = ldexp(1.0, z);
+    points->clear();
+    for (size_t i = ring.size(); i-- > 0; ) {
+        double lat = std::max(-89.9, std::min(89.9, ring[i].y)) * M_PI / 180,
+               px = ((ring[i].x + 180) / 360 * n - x) * TILEEXTENT,
+               py = ((1 - log(tan(M_PI / 4 + lat / 2)) / M_PI) / 2 * n - y) * TILEEXTENT;
+        std::pair<int32_t, int32_t> p((int32_t) floor(px + 0.5), (int32_t) floor(py + 0.5));
+        if (points->empty() || points->back() != p) points->push_back(p);
     }
+    while (points->size() > 1 && points->front() == points->back())
+        points->pop_back();
+    if (points->size() < 3) return false;
 
-    /* Add the ID field, which defaults to "id" if a name isn't given. */
-    if (id_field_name == NULL) id_field_name = IDFIELD;
-    OGRFieldDefn field( id_field_name, OFTInteger );
-    if( layer->CreateField( &field ) != OGRERR_NONE ) {
-        std::cerr <<  "Creating " << id_field_name << " field failed.\n";
-        return NULL;
+    int64_t area = 0;
+    for (size_t i = 0, j = points->size() - 1; i < points->size(); j = i++)
+        area += (int64_t) (*points)[j].first * (*points)[i].second
+                - (int64_t) (*points)[i].first * (*points)[j].second;
+    return (exterior ? area > 0 : area < 0);
+}
+
+void encode_tile(tile_job_t *job, const job_options_t &options) {
+    /* Encode the job's parts as a vector tile with one layer, with one
+     * polygon feature for each feature, with its ID, if it has anything
+     * left at this zoom. Parts of the same feature are always together. */
+    std::string features, values;
+    std::map<feature_id_t, size_t> value_index;
+    std::vector<std::pair<int32_t, int32_t> > points;
+    const coverage_t &parts = job->parts;
+    for (size_t i = 0; i < parts.size(); ) {
+        size_t feature = parts[i].feature;
+        std::string geometry;
+        int32_t cx = 0, cy = 0;
+        for (; i < parts.size() && parts[i].feature == feature; i++) {
+            const ring_list_t &rings = parts[i].rings;
+            for (size_t k = 0; k < rings.size(); k++) {
+                if (!tile_ring(rings[k], job->z, job->x, job->y, k == 0, &points)) {
+                    if (k == 0) break;  // the holes go with it
+                    continue;
+                }
+                put_varint(&geometry, 1 | (1 << 3));            // MoveTo
+                put_varint(&geometry, zigzag(points[0].first - cx));
+                put_varint(&geometry, zigzag(points[0].second - cy));
+                put_varint(&geometry, 2 | ((points.size() - 1) << 3));  // LineTo
+                for (size_t j = 1; j < points.size(); j++) {
+                    put_varint(&geometry, zigzag(points[j].first - points[j - 1].first));
+                    put_varint(&geometry, zigzag(points[j].second - points[j - 1].second));
+                }
+                put_varint(&geometry, 7 | (1 << 3));            // ClosePath
+                cx = points.back().first;
+                cy = points.back().second;
+            }
+        }
+        if (geometry.empty()) continue;
+
+        feature_id_t id = (*options.tile_ids)[feature];
+        if (value_index.find(id) == value_index.end()) {
+            std::string value;
+            size_t index = value_index.size();
+            put_varint_field(&value, 4, (uint64_t) (int64_t) id);   // int_value
+            put_field(&values, 4, value);
+            value_index[id] = index;
+        }
+        std::string message, tags;
+        if (id >= 0) put_varint_field(&message, 1, id);
+        put_varint(&tags, 0);
+        put_varint(&tags, value_index[id]);
+        put_field(&message, 2, tags);
+        put_varint_field(&message, 3, 3);                           // POLYGON
+        put_field(&message, 4, geometry);
+        put_field(&features, 2, message);
     }
-    return ds;
+    if (features.empty()) return;
+
+    std::string layer;
+    put_varint_field(&layer, 15, 2);                                // version
+    put_field(&layer, 1, options.tile_layer);
+    layer.append(features);
+    put_field(&layer, 3, IDFIELD);
+    layer.append(values);
+    put_varint_field(&layer, 5, TILEEXTENT);
+    put_field(&job->data, 3, layer);
 }
 
-void write_feature(OGRLayer *layer, OGRPolygon *geom, feature_id_t id) {
-    /* Create a new feature from the geometry and ID, and write it to the
-     * output layer. */
-    OGRFeature *feature = OGRFeature::CreateFeature( layer->GetLayerDefn() );
-    feature->SetField(0, id);
-    feature->SetGeometryDirectly(geom); // saves having to destroy it manually
-    if(layer->CreateFeature( feature ) != OGRERR_NONE) {
-        std::cerr << "Failed to create feature in output.\n";
-        exit( 1 );
+void process_tile(tile_job_t *job, const job_options_t &options) {
+    /* Encode the tile, if it's in the zoom range, and clip its parts to its
+     * children, if there are any more zoom levels to go. */
+    if (job->z >= options.min_zoom)
+        encode_tile(job, options);
+    for (int child = 0; job->z < options.max_zoom && child < 4; child++) {
+        OGREnvelope rect;
+        tile_bounds(job->z + 1, 2 * job->x + (child & 1), 2 * job->y + (child >> 1), &rect);
+        for (size_t i = 0; i < job->parts.size(); i++) {
+            std::vector<ring_list_t> out;
+            clip_rings(job->parts[i].rings, rect, &out);
+            for (size_t k = 0; k < out.size(); k++) {
+                coverage_part_t part;
+                part.feature = job->parts[i].feature;
+                job->children[child].push_back(part);
+                job->children[child].back().rings.swap(out[k]);
+            }
+        }
     }
-    OGRFeature::DestroyFeature( feature );
+    coverage_t().swap(job->parts);
+}
+
+typedef struct {
+    uint64_t id, offset;
+    uint32_t length, run_length;
+} tile_entry_t;
+
+static bool tile_entry_less(const tile_entry_t &a, const tile_entry_t &b) {
+    return a.id < b.id;
+}
+
+static void put_directory(const std::vector<tile_entry_t> &entries, size_t first,
+                          size_t last, std::string *out) {
+    /* Encode the entries from first up to last as a PMTiles directory. */
+    put_varint(out, last - first);
+    for (size_t i = first; i < last; i++)
+        put_varint(out, entries[i].id - (i > first ? entries[i - 1].id : 0));
+    for (size_t i = first; i < last; i++)
+        put_varint(out, entries[i].run_length);
+    for (size_t i = first; i < last; i++)
+        put_varint(out, entries[i].length);
+    for (size_t i = first; i < last; i++) {
+        if (i > first && entries[i].offset == entries[i - 1].offset + entries[i - 1].length)
+            put_varint(out, 0);
+        else
+            put_varint(out, entries[i].offset + 1);
+    }
+}
+
+static void put_le(std::string *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out->push_back((char) ((value >> (8 * i)) & 0xff));
+}
+
+static std::string json_string(const char *text) {
+    /* Escape text to go between the quotes of a JSON string. */
+    std::string out;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            out.push_back('\\');
+            out.push_back(*c);
+        } else if ((unsigned char) *c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char) *c);
+            out += escape;
+        } else
+            out.push_back(*c);
+    }
+    return out;
+}
+
+static void put_position(std::string *out, double lon, double lat) {
+    put_le(out, (uint32_t) (int32_t) floor(lon * 1e7 + 0.5), 4);
+    put_le(out, (uint32_t) (int32_t) floor(lat * 1e7 + 0.5), 4);
+}
+
+class TileArchive {
+    /* Collects encoded tiles, in any order, in a temporary file, and then
+     * writes them out as a PMTiles archive, sorted by tile ID. Small tiles
+     * that are exactly the same, like the ones in the middle of a big
+     * feature, are only stored once, and runs of them are a single entry. */
+public:
+    TileArchive() : file_(tmpfile()), ok_(file_ != NULL), size_(0), contents_(0) {}
+
+    ~TileArchive() {
+        if (file_ != NULL) fclose(file_);
+    }
+
+    size_t tiles() const { return entries_.size(); }
+
+    void add(int z, int x, int y, const std::string &data) {
+        tile_entry_t entry = { tile_id(z, x, y), size_, (uint32_t) data.size(), 1 };
+        if (data.size() <= DEDUPEBYTES) {
+            std::map<std::string, uint64_t>::iterator seen = seen_.find(data);
+            if (seen != seen_.end()) {
+                entry.offset = seen->second;
+                entries_.push_back(entry);
+                return;
+            }
+            seen_[data] = size_;
+        }
+        if (ok_) ok_ = (fwrite(data.data(), 1, data.size(), file_) == data.size());
+        size_ += data.size();
+        contents_++;
+        entries_.push_back(entry);
+    }
+
+    bool write(const char *filename, const job_options_t &options, const OGREnvelope &bounds) {
+        /* Write the archive: the header and the root directory, in the
+         * first MAXROOTBYTES, then the tile data in tile ID order, then the
+         * metadata and any leaf directories. The spec lets the sections go
+         * in any order, since the header says where each one is. */
+        if (!ok_ || fflush(file_) != 0) return false;
+        FILE *out = fopen(filename, "wb");
+        if (out == NULL) return false;
+
+        /* Copy the tile data over in ID order, which moves it, so renumber
+         * the offsets, and merge runs of the same tile into one entry. The
+         * header goes in last, once the directories are known. */
+        std::sort(entries_.begin(), entries_.end(), tile_entry_less);
+        std::vector<tile_entry_t> runs;
+        std::map<uint64_t, uint64_t> moved;
+        std::vector<char> buffer;
+        uint64_t offset = 0;
+        std::string chunk(MAXROOTBYTES, '\0');
+        bool ok = true;
+        for (size_t i = 0; ok && i < entries_.size(); i++) {
+            tile_entry_t entry = entries_[i];
+            std::map<uint64_t, uint64_t>::iterator it = moved.find(entry.offset);
+            if (it != moved.end())
+                entry.offset = it->second;
+            else {
+                if (entry.length <= DEDUPEBYTES) moved[entry.offset] = offset;
+                buffer.resize(entry.length);
+                ok = (fseeko(file_, entry.offset, SEEK_SET) == 0
+                      && fread(&buffer[0], 1, entry.length, file_) == entry.length);
+                entry.offset = offset;
+                offset += entry.length;
+                chunk.append(&buffer[0], entry.length);
+                if (chunk.size() >= (1 << 20)) {
+                    ok = ok && (fwrite(chunk.data(), 1, chunk.size(), out) == chunk.size());
+                    chunk.clear();
+                }
+            }
+            if (!runs.empty() && runs.back().id + runs.back().run_length == entry.id
+                    && runs.back().offset == entry.offset && runs.back().length == entry.length)
+                runs.back().run_length++;
+            else
+                runs.push_back(entry);
+        }
+        ok = ok && (fwrite(chunk.data(), 1, chunk.size(), out) == chunk.size());
+        uint64_t data_offset = MAXROOTBYTES, data_length = offset;
+
+        /* The root directory has to fit in what's left of the first
+         * MAXROOTBYTES after the header; if all the entries don't, they go
+         * into leaf directories, and the root just points to those. */
+        std::string root, leaves;
+        put_directory(runs, 0, runs.size(), &root);
+        for (size_t leaf_size = 4096; root.size() > MAXROOTBYTES - 127; leaf_size *= 2) {
+            std::vector<tile_entry_t> pointers;
+            root.clear();
+            leaves.clear();
+            for (size_t first = 0; first < runs.size(); first += leaf_size) {
+                size_t last = std::min(runs.size(), first + leaf_size);
+                tile_entry_t pointer = { runs[first].id, leaves.size(), 0, 0 };
+                put_directory(runs, first, last, &leaves);
+                pointer.length = leaves.size() - pointer.offset;
+                pointers.push_back(pointer);
+            }
+            put_directory(pointers, 0, pointers.size(), &root);
+        }
+
+        /* The layer name goes in twice, and everything else fits in the
+         * rest. */
+        std::string layer = json_string(options.tile_layer);
+        std::vector<char> json(2 * layer.size() + strlen(IDFIELD) + 256);
+        snprintf(&json[0], json.size(),
+                 "{\"name\":\"%s\",\"format\":\"pbf\",\"vector_layers\":[{\"id\":\"%s\","
+                 "\"fields\":{\"%s\":\"Number\"},\"minzoom\":%d,\"maxzoom\":%d}]}",
+                 layer.c_str(), layer.c_str(), IDFIELD,
+                 options.min_zoom, options.max_zoom);
+        std::string metadata(&json[0]);
+
+        uint64_t metadata_offset = data_offset + data_length,
+                 leaves_offset = metadata_offset + metadata.size();
+        ok = ok && (fwrite(metadata.data(), 1, metadata.size(), out) == metadata.size())
+                && (fwrite(leaves.data(), 1, leaves.size(), out) == leaves.size());
+
+        std::string header("PMTiles\x03", 8);
+        put_le(&header, 127, 8);                    // root directory
+        put_le(&header, root.size(), 8);
+        put_le(&header, metadata_offset, 8);
+        put_le(&header, metadata.size(), 8);
+        put_le(&header, leaves_offset, 8);
+        put_le(&header, leaves.size(), 8);
+        put_le(&header, data_offset, 8);
+        put_le(&header, data_length, 8);
+        put_le(&header, entries_.size(), 8);        // addressed tiles
+        put_le(&header, runs.size(), 8);            // tile entries
+        put_le(&header, contents_, 8);              // tile contents
+        header.push_back(1);                        // clustered
+        header.push_back(1);                        // no internal compression
+        header.push_back(1);                        // no tile compression
+        header.push_back(1);                        // vector tiles
+        header.push_back((char) options.min_zoom);
+        header.push_back((char) options.max_zoom);
+        put_position(&header, bounds.MinX, bounds.MinY);
+        put_position(&header, bounds.MaxX, bounds.MaxY);
+        header.push_back((char) options.min_zoom);
+        put_position(&header, (bounds.MinX + bounds.MaxX) / 2, (bounds.MinY + bounds.MaxY) / 2);
+        header.append(root);
+        ok = ok && fseeko(out, 0, SEEK_SET) == 0
+                && fwrite(header.data(), 1, header.size(), out) == header.size();
+        return (fclose(out) == 0 && ok);
+    }
+
+private:
+    FILE *file_;
+    bool ok_;
+    uint64_t size_, contents_;
+    std::vector<tile_entry_t> entries_;
+    std::map<std::string, uint64_t> seen_;
+};
+
+bool write_tiles(const char *filename, coverage_t *parts, const OGREnvelope &extent,
+                 int threads, const job_options_t &options, size_t *tiles) {
+    /* Make vector tiles of the parts, which are used up, and write them to
+     * a PMTiles archive. Tiles are done depth first from the single tile at
+     * zoom 0, so only the parts of the tiles on the way down to the ones
+     * being done are held at once. Returns false if it couldn't write it. */
+    WorkerPool<tile_job_t> pool(threads, 0, process_tile, options);
+    TileArchive archive;
+    std::vector<tile_job_t*> pending(1, new tile_job_t);
+    pending[0]->z = pending[0]->x = pending[0]->y = 0;
+    pending[0]->bytes = 0;
+    pending[0]->parts.swap(*parts);
+
+    for (;;) {
+        if (!pending.empty() && !pool.full(0)) {
+            pool.submit(pending.back());
+            pending.pop_back();
+            continue;
+        }
+        tile_job_t *job = pool.finished();
+        if (job == NULL) break;
+        if (!job->data.empty())
+            archive.add(job->z, job->x, job->y, job->data);
+        for (int child = 0; child < 4; child++) {
+            if (job->children[child].empty()) continue;
+            tile_job_t *next = new tile_job_t;
+            next->z = job->z + 1;
+            next->x = 2 * job->x + (child & 1);
+            next->y = 2 * job->y + (child >> 1);
+            next->bytes = 0;
+            next->parts.swap(job->children[child]);
+            pending.push_back(next);
+        }
+        delete job;
+    }
+    *tiles = archive.tiles();
+    return archive.write(filename, options, extent);
+}
+
+/* Cost estimates. With -estimate, nothing is written: the input layer is
+ * read once to count the vertices of every feature, and again to split a
+ * sample of them on the main thread, just as the options say, and what the
+ * whole job would cost is extrapolated from that. The biggest features,
+ * which tend to take most of the time, are always in the sample; the rest
+ * of it is every so many of the others, whose costs are scaled up in
+ * proportion to their vertices. */
+#define ESTIMATESAMPLE 200      // features split
+#define ESTIMATEBIGGEST 20      // of which the biggest in the layer
+
+typedef struct {
+    double vertices, pieces, piece_vertices, wkb_bytes, seconds;
+} estimate_t;
+
+static void add_estimate(estimate_t *total, const estimate_t &part, double scale) {
+    total->vertices += part.vertices * scale;
+    total->pieces += part.pieces * scale;
+    total->piece_vertices += part.piece_vertices * scale;
+    total->wkb_bytes += part.wkb_bytes * scale;
+    total->seconds += part.seconds * scale;
+}
+
+static void measure_pieces(const OGRPolyList &pieces, estimate_t *cost) {
+    for (size_t i = 0; i < pieces.size(); i++) {
+        cost->pieces++;
+        cost->piece_vertices += geometry_vertices(pieces[i]);
+        cost->wkb_bytes += pieces[i]->WkbSize();
+    }
+}
+
+struct BiggerFeature {
+    const std::vector<size_t> &v;
+    BiggerFeature(const std::vector<size_t> &v) : v(v) {}
+    bool operator()(size_t a, size_t b) const { return v[a] > v[b]; }
+};
+
+int estimate_costs(OGRLayer *layer, OGRCoordinateTransformation *transform,
+                   const job_options_t &options, int threads, size_t memory_budget,
+                   bool index, bool adjacency, bool tiles) {
+    /* Print what splitting the layer would take, as estimated above. */
+    double started = wallclock();
+    std::vector<size_t> vertices;
+    double total_vertices = 0;
+    layer->ResetReading();
+    OGRFeature *feature;
+    while ((feature = layer->GetNextFeature()) != NULL) {
+        vertices.push_back(geometry_vertices(feature->GetGeometryRef()));
+        total_vertices += vertices.back();
+        OGRFeature::DestroyFeature( feature );
+    }
+    double reading = wallclock() - started;
+
+    /* Pick the sample: 1 for the biggest features, which stand for
+     * themselves, and 2 for the others, which stand for everything else.
+     * Features that would be split out of core aren't split here, in
+     * either part of the sample, and are counted with everything else. */
+    std::vector<size_t> order;
+    std::vector<signed char> sampled(vertices.size(), 0);
+    for (size_t i = 0; i < vertices.size(); i++)
+        if (options.spill_vertices == 0 || vertices[i] <= options.spill_vertices)
+            order.push_back(i);
+        else
+            sampled[i] = -1;
+    size_t biggest = std::min(order.size(), (size_t) ESTIMATEBIGGEST);
+    std::partial_sort(order.begin(), order.begin() + biggest, order.end(),
+                      BiggerFeature(vertices));
+    double rest_vertices = total_vertices;
+    for (size_t i = 0; i < biggest; i++) {
+        sampled[order[i]] = 1;
+        rest_vertices -= vertices[order[i]];
+    }
+    size_t rest = order.size() - biggest,
+           step = std::max((size_t) 1, rest / (ESTIMATESAMPLE - ESTIMATEBIGGEST));
+    for (size_t i = 0, seen = 0; i < vertices.size(); i++)
+        if (sampled[i] == 0 && seen++ % step == 0)
+            sampled[i] = 2;
+
+    /* Split the sample, timing each feature from reprojection on. */
+    estimate_t exact = { 0, 0, 0, 0, 0 }, sample = { 0, 0, 0, 0, 0 };
+    double slowest = 0;
+    size_t position = 0;
+    layer->ResetReading();
+    while ((feature = layer->GetNextFeature()) != NULL) {
+        size_t i = position++;
+        if (i >= sampled.size() || sampled[i] <= 0) {
+            OGRFeature::DestroyFeature( feature );
+            continue;
+        }
+        double split_started = wallclock();
+        feature_job_t job;
+        job.geometry = feature->StealGeometry();
+        job.original = NULL;
+        OGRFeature::DestroyFeature( feature );
+        if (transform != NULL && job.geometry != NULL
+                && job.geometry->transform(transform) != OGRERR_NONE) {
+            delete job.geometry;
+            continue;
+        }
+        process_feature(&job, options);
+
+        estimate_t cost = { (double) vertices[i], 0, 0, 0, 0 };
+        measure_pieces(job.pieces, &cost);
+        measure_pieces(job.inner, &cost);
+        measure_pieces(job.outer, &cost);
+        delete_pieces(&job.pieces);
+        delete_pieces(&job.inner);
+        delete_pieces(&job.outer);
+        delete job.geometry;
+        cost.seconds = wallclock() - split_started;
+        slowest = std::max(slowest, cost.seconds);
+        add_estimate(sampled[i] == 1 ? &exact : &sample, cost, 1);
+    }
+
+    estimate_t total = exact;
+    if (sample.vertices > 0)
+        add_estimate(&total, sample, rest_vertices / sample.vertices);
+    total.vertices = total_vertices;
+
+    /* The pool holds up to two features per thread, or just one, apart
+     * from those split out of core; the layer-wide structures hold every
+     * vertex, in or out. */
+#ifndef WORKER_THREADS
+    threads = 1;
+#endif
+    size_t capacity = (threads > 1 ? 2 * threads : 1);
+    std::vector<size_t> largest;
+    for (size_t i = 0; i < order.size(); i++)
+        largest.push_back(vertices[order[i]]);
+    size_t held = std::min(capacity, largest.size());
+    std::partial_sort(largest.begin(), largest.begin() + held, largest.end(),
+                      std::greater<size_t>());
+    double in_flight = 0;
+    for (size_t i = 0; i < held; i++)
+        in_flight += (double) largest[i] * BYTESPERVERTEX;
+    if (memory_budget > 0 && held > 0)
+        in_flight = std::min(in_flight, std::max((double) memory_budget,
+                                                 (double) largest[0] * BYTESPERVERTEX));
+    double layer_bytes = 0;
+    if (options.mode == SPLIT_COVERAGE || tiles)
+        layer_bytes += total_vertices * sizeof(point_t);
+    if (index)
+        layer_bytes += total_vertices * sizeof(segment_t);
+    if (adjacency)
+        layer_bytes += total.piece_vertices * sizeof(segment_t);
+    double wall = reading + std::max(total.seconds / threads, slowest);
+
+    size_t sample_size = 0;
+    for (size_t i = 0; i < sampled.size(); i++)
+        if (sampled[i] > 0) sample_size++;
+    std::cout << "Estimated from " << sample_size << " of " << vertices.size()
+              << " features (" << (size_t) total_vertices << " vertices):\n"
+              << "  pieces written: " << (size_t) (total.pieces + 0.5) << "\n"
+              << "  vertices written: " << (size_t) (total.piece_vertices + 0.5) << "\n"
+              << "  output geometry: " << total.wkb_bytes / 1048576 << " MB of WKB\n"
+              << "  peak memory: " << (in_flight + layer_bytes) / 1048576 << " MB ("
+              << in_flight / 1048576 << " MB for features in flight)\n"
+              << "  wall time: " << wall << " s on " << threads << " threads, "
+              << "of which " << reading << " s is reading\n";
+    if (options.mode == SPLIT_COVERAGE)
+        std::cout << "Coverage mode also cuts each feature where its neighbours are "
+                  << "cut, so expect more pieces than this.\n";
+    if (order.size() < vertices.size())
+        std::cout << vertices.size() - order.size() << " features would be split "
+                  << "out of core, and are estimated from the rest.\n";
+    return 0;
+}
+
+/* The OGR drivers we know how to register one at a time. Each is matched
+ * either by the file extension of a datasource name, or by its driver name as
+ * given to -f. These are all drivers that OGR always builds in, so the
+ * Register functions are safe to link against. */
+typedef struct {
+    const char *name;
+    const char *extension;
+    void (*register_driver)(void);
+} driver_entry_t;
+
+static const driver_entry_t known_drivers[] = {
+    { "ESRI Shapefile", "shp",     RegisterOGRShape },
+    { "ESRI Shapefile", "dbf",     RegisterOGRShape },
+    { "GeoJSON",        "json",    RegisterOGRGeoJSON },
+    { "GeoJSON",        "geojson", RegisterOGRGeoJSON },
+    { "CSV",            "csv",     RegisterOGRCSV },
+    { "MapInfo File",   "tab",     RegisterOGRTAB },
+    { "MapInfo File",   "mif",     RegisterOGRTAB },
+    { "KML",            "kml",     RegisterOGRKML },
+    { "Memory",         NULL,      RegisterOGRMEM },
+    { NULL,             NULL,      NULL }
+};
+
+const driver_entry_t *find_driver(const char *name, const char *datasource) {
+    /* Look up a driver entry by driver name, or failing that, by the file
+     * extension of the datasource. Returns NULL if we don't know it. */
+    const driver_entry_t *entry;
+    const char *extension = NULL;
+
+    if (datasource != NULL) {
+        extension = strrchr(datasource, '.');
+        if (extension != NULL && strchr(extension, '/') == NULL)
+            extension++;
+        else
+            extension = NULL;
+    }
+    for (entry = known_drivers; entry->register_driver != NULL; entry++) {
+        if (name != NULL && EQUAL(name, entry->name))
+            return entry;
+        if (name == NULL && extension != NULL && entry->extension != NULL
+                && EQUAL(extension, entry->extension))
+            return entry;
+    }
+    return NULL;
+}
+
+int register_drivers(const char *source_name, const char *driver_name) {
+    /* Register only the drivers needed to read source_name and write with
+     * driver_name, since OGRRegisterAll() can take a noticeable fraction of
+     * the run time on small jobs. If we can't tell which driver a datasource
+     * needs (a directory, a database connection string, an unusual format),
+     * fall back to registering everything. Returns the number of drivers
+     * registered. */
+    const driver_entry_t *input = find_driver(NULL, source_name),
+                         *output = find_driver(driver_name, NULL);
+
+    if (input == NULL || output == NULL) {
+        OGRRegisterAll();
+        return OGRSFDriverRegistrar::GetRegistrar()->GetDriverCount();
+    }
+    input->register_driver();
+    if (output->register_driver != input->register_driver)
+        output->register_driver();
+    return OGRSFDriverRegistrar::GetRegistrar()->GetDriverCount();
 }
 
 void usage(void) {
-    std::cerr << "\nUsage: polysplit [opts] <input> <output>\n\n"
+    std::cerr << "\nUsage: polysplit [opts] <input> <output>\n"
+              << "       polysplit -estimate [opts] <input>\n"
+              << "       polysplit -q <location index>\n\n"
               << "\t-i\tinput layer name\n"
               << "\t-o\toutput layer name\n"
               << "\t-f\tOGR output driver name\n"
+              << "\t-t_srs\tReproject the output to this SRS\n"
               << "\t-n\tID field name (must be integer type)\n"
               << "\t-m\tMax vertices per output polygon\n"
+              << "\t-A\tMax bounding box area per output polygon\n"
+              << "\t-S\tMax bounding box width or height per output polygon\n"
+              << "\t-R\tMax bounding box aspect ratio per output polygon\n"
+              << "\t-F\tMax ratio of bounding box area to polygon area\n"
+              << "\t-H\tMax holes per output polygon\n"
+              << "\t-T\tMax seconds to spend splitting each feature\n"
+              << "\t-N\tMax split steps for each feature\n"
+              << "\t-M\tMerge adjacent pieces back together where they fit\n"
+              << "\t-e\tDrop vertices within this distance of collinear\n"
+              << "\t-t\tTriangulate the output polygons\n"
+              << "\t-c\tSplit into convex polygons\n"
+              << "\t-z\tSplit into horizontal trapezoids\n"
+              << "\t-C\tSplit the layer as a coverage, keeping shared edges\n"
+              << "\t-a\tAlso write inner and outer approximations of this many vertices\n"
+              << "\t-l\tAlso write a location index to this file\n"
+              << "\t-Q\tWrite features that fail to this CSV file\n"
+              << "\t-j\tSplit features on this many threads (0 for one per CPU)\n"
+              << "\t-verify\tCheck that each feature's pieces tile it\n"
+              << "\t-memory\tMegabytes of memory features in flight may use\n"
+              << "\t-spill\tSplit features of more vertices than this out of core\n"
+              << "\t-tiles\tAlso write vector tiles to this PMTiles file\n"
+              << "\t-minzoom\tLowest zoom level of vector tiles (default 0)\n"
+              << "\t-maxzoom\tHighest zoom level of vector tiles (default 10)\n"
+              << "\t-precision\tStore location index coordinates to this precision\n"
+              << "\t-compress\tCompress location index edges with zstd, lz4 or deflate\n"
+              << "\t-adjacency\tAlso write which pieces share edges to this CSV file\n"
+              << "\t-attributes\tGive each polygon its bounds, area, vertices, holes and depth\n"
+              << "\t-estimate\tJust estimate what splitting the input would take\n"
+              << "\t-lonlat\tTake input without an SRS as longitude and latitude\n"
+              << "\t-q\tLook up points in a location index\n"
               << "\t-v\tVerbose mode\n\n";
     exit(1);
 }
@@ -165,17 +4390,96 @@ int main(int argc, char** argv) {
     const char *source_name, *src_layer_name = NULL,
                *dest_name, *dest_layer_name = NULL,
                *driver_name = OUTPUTDRIVER,
-               *id_field_name = NULL;
-    int max_vertices = MAXVERTICES,
+               *id_field_name = NULL,
+               *index_name = NULL,
+               *quarantine_name = NULL,
+               *tiles_name = NULL,
+               *codec = NULL,
+               *adjacency_name = NULL;
+    int approx_vertices = 0,
         opt;
+    double tolerance = -1;
+    OGRSpatialReference *target_srs = NULL;
+    OGRCoordinateTransformation *transform = NULL;
+    static const struct option long_options[] = {
+        { "t_srs", required_argument, NULL, OPT_T_SRS },
+        { "verify", no_argument, NULL, OPT_VERIFY },
+        { "memory", required_argument, NULL, OPT_MEMORY },
+        { "spill", required_argument, NULL, OPT_SPILL },
+        { "tiles", required_argument, NULL, OPT_TILES },
+        { "minzoom", required_argument, NULL, OPT_MINZOOM },
+        { "maxzoom", required_argument, NULL, OPT_MAXZOOM },
+        { "precision", required_argument, NULL, OPT_PRECISION },
+        { "compress", required_argument, NULL, OPT_COMPRESS },
+        { "adjacency", required_argument, NULL, OPT_ADJACENCY },
+        { "attributes", no_argument, NULL, OPT_ATTRIBUTES },
+        { "estimate", no_argument, NULL, OPT_ESTIMATE },
+        { "lonlat", no_argument, NULL, OPT_LONLAT },
+        { NULL, 0, NULL, 0 }
+    };
+    split_limits_t limits = { MAXVERTICES, 0, 0, 0, 0, -1, 0, 0 };
+    split_mode_t mode = SPLIT_QUADRANTS;
+    bool query = false,
+         merge = false,
+         verify = false,
+         attributes = false,
+         estimate = false,
+         lonlat = false;
+    int threads = 1;
+    size_t memory_budget = 0;
+    long spill_vertices = 0;
+    int min_zoom = 0,
+        max_zoom = 10;
+    double precision = 0;
 
-    while ((opt = getopt(argc, argv, "i:o:f:n:m:v")) != -1) {
+    while ((opt = getopt_long_only(argc, argv, "i:o:f:n:m:A:S:R:F:H:T:N:Me:tczCa:l:Q:j:qv",
+                                   long_options, NULL)) != -1) {
         switch (opt) {
             case 'i': src_layer_name = optarg;      break;
             case 'o': dest_layer_name = optarg;     break;
             case 'f': driver_name = optarg;         break;
             case 'n': id_field_name = optarg;       break;
-            case 'm': max_vertices = atoi(optarg);  break;
+            case 'm': limits.max_vertices = atoi(optarg); break;
+            case 'A': limits.max_area = atof(optarg);   break;
+            case 'S': limits.max_side = atof(optarg);   break;
+            case 'R': limits.max_aspect = atof(optarg); break;
+            case 'F': limits.max_fill = atof(optarg);   break;
+            case 'H': limits.max_holes = atoi(optarg);  break;
+            case 'T': limits.max_seconds = atof(optarg); break;
+            case 'N': limits.max_nodes = atol(optarg);  break;
+            case 'M': merge = true;                 break;
+            case 'e': tolerance = atof(optarg);     break;
+            case 't': mode = SPLIT_TRIANGLES;       break;
+            case 'c': mode = SPLIT_CONVEX;          break;
+            case 'z': mode = SPLIT_TRAPEZOIDS;      break;
+            case 'C': mode = SPLIT_COVERAGE;        break;
+            case 'a': approx_vertices = atoi(optarg); break;
+            case 'l': index_name = optarg;          break;
+            case 'Q': quarantine_name = optarg;     break;
+            case 'j': threads = atoi(optarg);       break;
+            case OPT_VERIFY: verify = true;         break;
+            case OPT_MEMORY:
+                if (atof(optarg) < 0) usage();
+                memory_budget = (size_t) (atof(optarg) * 1024 * 1024);
+                break;
+            case OPT_SPILL: spill_vertices = atol(optarg); break;
+            case OPT_TILES: tiles_name = optarg;    break;
+            case OPT_MINZOOM: min_zoom = atoi(optarg); break;
+            case OPT_MAXZOOM: max_zoom = atoi(optarg); break;
+            case OPT_PRECISION: precision = atof(optarg); break;
+            case OPT_COMPRESS: codec = optarg;      break;
+            case OPT_ADJACENCY: adjacency_name = optarg; break;
+            case OPT_ATTRIBUTES: attributes = true; break;
+            case OPT_ESTIMATE: estimate = true;     break;
+            case OPT_LONLAT: lonlat = true;         break;
+            case 'q': query = true;                 break;
+            case OPT_T_SRS:
+                target_srs = new OGRSpatialReference();
+                if (target_srs->SetFromUserInput(optarg) != OGRERR_NONE) {
+                    std::cerr << "Can't make sense of SRS " << optarg << ".\n";
+                    exit( 1 );
+                }
+                break;
             case 'v': debug = true;                 break;
             default: usage();
         }
@@ -183,12 +4487,33 @@ int main(int argc, char** argv) {
     argc -= optind;
     argv += optind;
 
-    if (argc < 2 || max_vertices <= 5) usage();
+    /* In query mode, the only argument is the location index. */
+    if (query) {
+        if (argc < 1) usage();
+        return query_location_index(argv[0]);
+    }
+
+    if (argc < (estimate ? 1 : 2) || limits.max_vertices <= 5 || approx_vertices < 0
+            || limits.max_area < 0 || limits.max_side < 0
+            || (limits.max_aspect != 0 && limits.max_aspect < 1)
+            || (limits.max_fill != 0 && limits.max_fill < 1)
+            || limits.max_seconds < 0 || limits.max_nodes < 0 || threads < 0
+            || spill_vertices < 0
+            || min_zoom < 0 || max_zoom < min_zoom || max_zoom > MAXZOOM
+            || precision < 0
+            || (approx_vertices > 0 && approx_vertices < 4)
+            || (mode == SPLIT_COVERAGE && (limits.max_seconds > 0 || limits.max_nodes > 0
+                                           || merge || approx_vertices > 0 || verify)))
+        usage();
     source_name = argv[0];
-    dest_name = argv[1];
+    dest_name = (argc > 1 ? argv[1] : NULL);
 
     /* Register the OGR datasource drivers. */
-    OGRRegisterAll();
+    double started = wallclock();
+    int drivers = register_drivers(source_name, driver_name);
+    if (debug)
+        std::cerr << "Registered " << drivers << " OGR drivers in "
+                  << (wallclock() - started) * 1000 << " ms.\n";
 
     /* Open the input data source */
     OGRDataSource* source;
@@ -206,6 +4531,49 @@ int main(int argc, char** argv) {
         exit( 1 );
     }
 
+    /* Set up reprojection, if asked for. Geometries are transformed as they
+     * are read, one ring at a time, which OGR does with a single call on the
+     * ring's coordinate arrays. */
+    if (target_srs != NULL) {
+        OGRSpatialReference *source_srs = srcLayer->GetSpatialRef();
+        if (source_srs == NULL) {
+            std::cerr << "Input layer has no SRS, so it can't be reprojected.\n";
+            exit( 1 );
+        }
+#if GDAL_VERSION_MAJOR >= 3
+        /* Keep x as longitude and y as latitude, whatever the SRS says. */
+        source_srs->SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+        target_srs->SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+#endif
+        transform = OGRCreateCoordinateTransformation(source_srs, target_srs);
+        if (transform == NULL) {
+            std::cerr << "Can't reproject the input layer to the given SRS.\n";
+            exit( 1 );
+        }
+    }
+
+    /* If the output is in longitude and latitude, features that cross the
+     * antimeridian get cut there. Without an SRS, only -lonlat says so; the
+     * extent alone can't tell, since projected data can fit in it too. */
+    OGRSpatialReference *output_srs = (target_srs != NULL ? target_srs
+                                                          : srcLayer->GetSpatialRef());
+    bool geographic = lonlat || (output_srs != NULL && output_srs->IsGeographic());
+
+    /* Make sure the location index can be compressed as asked before
+     * doing all the work. */
+    if (codec != NULL) {
+        codec = index_codec(codec);
+        if (codec == NULL) exit( 1 );
+    }
+
+    /* Vector tiles are in web mercator, which is made from longitude and
+     * latitude. */
+    if (tiles_name != NULL && !geographic) {
+        std::cerr << "Vector tiles need longitude and latitude output; "
+                  << "try -t_srs EPSG:4326, or -lonlat if it already is.\n";
+        exit( 1 );
+    }
+
     /* Find the ID field on the input layer, if provided. Freak out if it's not
      * there, or if it's not an integer field. */
     int id_field = -1;
@@ -223,9 +4591,35 @@ int main(int argc, char** argv) {
         }
     } 
     
+    /* In estimate mode, that's as far as it goes. */
+    if (estimate) {
+        job_options_t estimate_options = { limits, mode, tolerance, geographic, merge,
+                                           verify, approx_vertices,
+                                           (size_t) spill_vertices, min_zoom, max_zoom,
+                                           NULL, NULL };
+        return estimate_costs(srcLayer, transform, estimate_options,
+                              threads > 0 ? threads : CPLGetNumCPUs(), memory_budget,
+                              index_name != NULL, adjacency_name != NULL,
+                              tiles_name != NULL);
+    }
+
+    /* Start the quarantine file, if asked for. */
+    FILE *quarantine = NULL;
+    if (quarantine_name != NULL) {
+        quarantine = open_quarantine(quarantine_name);
+        if (quarantine == NULL) {
+            std::cerr << "Can't create quarantine file " << quarantine_name << ".\n";
+            exit( 1 );
+        }
+    }
+
     /* Create the output data source. */
     OGRDataSource* dest = create_destination(driver_name, dest_name,
-                                             dest_layer_name, id_field_name);
+                                             dest_layer_name, target_srs,
+                                             id_field_name,
+                                             mode != SPLIT_QUADRANTS
+                                                 && mode != SPLIT_COVERAGE,
+                                             approx_vertices > 0, attributes);
     if( dest == NULL ) exit( 1 );
 
     /* Get the output layer. */
@@ -233,43 +4627,394 @@ int main(int argc, char** argv) {
                                            : dest->GetLayer(0));
 
     /* Some stats. */
-    int features_read = 0, features_written = 0,
+    int features_read = 0, features_written = 0, features_failed = 0,
+        over_budget = 0, features_spilled = 0,
         total = srcLayer->GetFeatureCount();
 
-    /* Main loop: Iterate over each feature in the input layer. */
-    OGRFeature *feature;
+    /* The edges of every feature, if we're building a location index. */
+    std::vector<segment_t> index_segments;
+    std::vector<feature_id_t> index_ids;
+
+    /* In coverage mode, the whole layer is read in before it's split. */
+    coverage_t coverage;
+    std::vector<feature_id_t> coverage_ids;
+    OGREnvelope coverage_extent;
+
+    /* Every feature's rings, if we're making vector tiles. In coverage
+     * mode, the coverage is used instead. */
+    coverage_t tile_parts;
+    std::vector<feature_id_t> tile_ids;
+    OGREnvelope tile_extent;
+    std::string tile_layer(dest_layer_name ? dest_layer_name : srcLayer->GetName());
+
+    /* The edges of every piece written, if we're finding which pieces are
+     * adjacent. */
+    adjacency_t adjacency_table;
+    adjacency_t *adjacency = (adjacency_name != NULL ? &adjacency_table : NULL);
+
+    /* How many polygons each clipper cut, and how long it took. */
+    long clipped[2] = { 0, 0 };
+    double clip_seconds[2] = { 0, 0 };
+
+    /* What --verify found wrong, feature by feature. */
+    std::vector<std::pair<feature_id_t, std::string> > problems;
+    int features_verified = 0;
+
+    /* Everything else is done by feature jobs, in the worker pool. With
+     * one thread, they're done on the main thread. */
+    job_options_t options = { limits, mode, tolerance, geographic, merge,
+                              verify, approx_vertices, (size_t) spill_vertices,
+                              min_zoom, max_zoom, tile_layer.c_str(),
+                              mode == SPLIT_COVERAGE ? &coverage_ids : &tile_ids };
+    if (threads == 0) threads = CPLGetNumCPUs();
+#ifndef WORKER_THREADS
+    if (threads > 1)
+        std::cerr << "WARNING: this GDAL is too old to split on more than one thread.\n";
+#endif
+    WorkerPool<feature_job_t> pool(threads > 1 ? threads : 0, memory_budget,
+                                   process_feature, options);
+
+    /* Main loop: Iterate over each feature in the input layer, handing each
+     * one to the pool, and writing out the pieces of each one that comes
+     * back, until there are none left either way. */
     srcLayer->ResetReading();
+    OGRFeature *feature = srcLayer->GetNextFeature();
 
-    while( (feature = srcLayer->GetNextFeature()) != NULL ) {
-        /* Make an empty parts list, and get the ID and geometry from the
-         * input. */
-        OGRPolyList pieces;
+    for (;;) {
+        if (feature != NULL
+                && !pool.full(geometry_vertices(feature->GetGeometryRef()) * BYTESPERVERTEX)) {
+            /* Get the ID and geometry from the input. */
+            feature_id_t id = (id_field >= 0 ? feature->GetFieldAsInteger(id_field)
+                                             : feature->GetFID());
+            OGRGeometry *geometry = feature->StealGeometry();
+            OGRFeature::DestroyFeature( feature );
+            feature = srcLayer->GetNextFeature();
+            features_read++;
+
+            /* Keep the geometry as it was read, in case it has to be
+             * quarantined. */
+            OGRGeometry *original = (quarantine != NULL && geometry != NULL
+                                     ? geometry->clone() : NULL);
+
+            /* Reproject it, if asked to. */
+            if (transform != NULL && geometry != NULL
+                    && geometry->transform(transform) != OGRERR_NONE) {
+                quarantine_feature(quarantine, id, "couldn't reproject it", original);
+                features_failed++;
+                delete original;
+                delete geometry;
+                continue;
+            }
+
+            if (options.spill_vertices > 0 && mode != SPLIT_COVERAGE
+                    && geometry_vertices(geometry) > options.spill_vertices) {
+                /* It's too big to split in memory, so split it a bucket at
+                 * a time, right here, writing the pieces as they're made.
+                 * If that fails partway, the pieces already written are
+                 * taken back out, along with its rings and edges. */
+                const char *error = prepare_geometry(&geometry, options);
+                if (error != NULL) {
+                    quarantine_feature(quarantine, id, error, original);
+                    features_failed++;
+                    delete original;
+                    delete geometry;
+                    continue;
+                }
+                size_t segments_kept = index_segments.size(), parts_kept = tile_parts.size(),
+                       pieces_kept = (adjacency ? adjacency->pieces.size() : 0);
+                OGREnvelope extent_kept = tile_extent;
+                if (index_name != NULL) {
+                    geometry_segments(geometry, index_ids.size(), &index_segments);
+                    index_ids.push_back(id);
+                }
+                if (tiles_name != NULL)
+                    stash_rings(geometry, id, &tile_parts, &tile_ids, &tile_extent);
+                bool exceeded = false;
+                std::vector<GIntBig> fids;
+                error = split_out_of_core(destLayer, id, geometry, options,
+                                          &features_written, adjacency, &fids, &exceeded);
+                if (exceeded) {
+                    std::cerr << "WARNING: feature " << id << " went over the time or "
+                              << "step limit, and was cut up on a grid instead\n";
+                    over_budget++;
+                }
+                if (error != NULL) {
+                    unwrite_pieces(destLayer, id, fids, &features_written);
+                    if (adjacency != NULL)
+                        forget_pieces(adjacency, pieces_kept);
+                    if (index_name != NULL) {
+                        index_segments.resize(segments_kept);
+                        index_ids.pop_back();
+                    }
+                    if (tiles_name != NULL) {
+                        tile_parts.resize(parts_kept);
+                        tile_ids.pop_back();
+                        tile_extent = extent_kept;
+                    }
+                    quarantine_feature(quarantine, id, error, original);
+                    features_failed++;
+                }
+                features_spilled++;
+                delete original;
+                continue;
+            }
+
+            if (mode == SPLIT_COVERAGE) {
+                /* Just keep its rings for later, tidied up the way
+                 * split_polygons() would. */
+                const char *error = prepare_geometry(&geometry, options);
+                if (error == NULL && geometry != NULL && !geometry->IsEmpty()
+                        && !geometry->IsValid()) {
+                    OGRGeometry *tidy = geometry->Buffer(0);
+                    if (tidy != NULL && tidy->IsValid()) {
+                        delete geometry;
+                        geometry = tidy;
+                    } else {
+                        delete tidy;
+                        error = "GEOS couldn't tidy up an invalid polygon";
+                    }
+                }
+                if (error != NULL) {
+                    quarantine_feature(quarantine, id, error, original);
+                    features_failed++;
+                    delete original;
+                    delete geometry;
+                    continue;
+                }
+                stash_rings(geometry, id, &coverage, &coverage_ids, &coverage_extent);
+                if (index_name != NULL) {
+                    geometry_segments(geometry, index_ids.size(), &index_segments);
+                    index_ids.push_back(id);
+                }
+                delete original;
+                delete geometry;
+                continue;
+            }
+
+            feature_job_t *job = new feature_job_t;
+            job->id = id;
+            job->bytes = geometry_vertices(geometry) * BYTESPERVERTEX;
+            job->geometry = geometry;
+            job->original = original;
+            job->state.exceeded = false;
+            job->state.error = NULL;
+            pool.submit(job);
+            continue;
+        }
+
+        feature_job_t *job = pool.finished();
+        if (job == NULL) break;
+        feature_id_t id = job->id;
+
+        if (job->state.exceeded) {
+            std::cerr << "WARNING: feature " << id << " went over the time or "
+                      << "step limit, and was cut up on a grid instead\n";
+            over_budget++;
+        }
+        for (int i = CLIP_GEOS; i <= CLIP_RECT; i++) {
+            clipped[i] += job->state.clipped[i];
+            clip_seconds[i] += job->state.clip_seconds[i];
+        }
+
+        /* If part of it got lost, none of it gets written; otherwise write
+         * the pieces, and the inner and outer approximations, if there are
+         * any, and take them all back out if any of that fails. We don't
+         * have to destroy each piece because write_feature calls
+         * SetGeometryDirectly. */
+        const char *error = job->state.error;
+        std::vector<GIntBig> fids;
+        size_t pieces_kept = (adjacency ? adjacency->pieces.size() : 0);
+        if (error == NULL && !write_pieces(destLayer, &job->pieces, id, KIND_PIECE,
+                                           &job->state.depths, &features_written,
+                                           adjacency, &fids))
+            error = "couldn't write a piece to the output";
+        if (error == NULL) {
+            bool inner_ok = write_pieces(destLayer, &job->inner, id, KIND_INNER, NULL,
+                                         &features_written, NULL, &fids),
+                 outer_ok = inner_ok
+                            && write_pieces(destLayer, &job->outer, id, KIND_OUTER, NULL,
+                                            &features_written, NULL, &fids);
+            if (!inner_ok || !outer_ok)
+                error = "couldn't write an approximation to the output";
+        }
+        if (error != NULL) {
+            unwrite_pieces(destLayer, id, fids, &features_written);
+            if (adjacency != NULL)
+                forget_pieces(adjacency, pieces_kept);
+            delete_pieces(&job->pieces);
+            delete_pieces(&job->inner);
+            delete_pieces(&job->outer);
+            quarantine_feature(quarantine, id, error, job->original);
+            features_failed++;
+        }
+
+        if (verify && error == NULL) {
+            features_verified++;
+            for (size_t i = 0; i < job->problems.size(); i++)
+                problems.push_back(std::make_pair(id, job->problems[i]));
+        }
+
+        if (index_name != NULL && error == NULL) {
+            geometry_segments(job->geometry, index_ids.size(), &index_segments);
+            index_ids.push_back(id);
+        }
+        if (tiles_name != NULL && error == NULL)
+            stash_rings(job->geometry, id, &tile_parts, &tile_ids, &tile_extent);
 
-        feature_id_t id = (id_field >= 0 ? feature->GetFieldAsInteger(id_field)
-                                         : feature->GetFID());
-        OGRGeometry *geometry = feature->GetGeometryRef();
-        
-        /* Recursively split the geometry, and write a new feature for each
-         * polygon that comes out. */
-        split_polygons(&pieces, geometry, max_vertices);
-        for (OGRPolyList::iterator it = pieces.begin(); it != pieces.end(); it++) {
-            write_feature(destLayer, *it, id);
-            features_written++;
-            /* We don't have to destroy each piece because write_feature calls
-             * SetGeometryDirectly. */
-        }
-
-        features_read++;
         if (debug)
             std::cerr << features_read << " / " << total << "\r";
 
-        OGRFeature::DestroyFeature( feature );
+        delete job->geometry;
+        delete job->original;
+        delete job;
+    }
+
+    /* Split the coverage, now that we have all of it. */
+    if (!coverage.empty()) {
+        OGRPolyList pieces;
+        std::vector<size_t> owners;
+        std::vector<int> depths;
+        if (tolerance >= 0)
+            prune_coverage(&coverage, tolerance);
+        split_coverage(&pieces, &owners, &depths, coverage, coverage_extent, limits, 0);
+
+        /* Write each feature's pieces together, so that if one of them
+         * fails, the rest can be taken back out, as for any other feature.
+         * The original geometries are long gone by now, so features that
+         * fail here are quarantined without them. */
+        std::vector<std::pair<size_t, size_t> > order(pieces.size());
+        for (size_t i = 0; i < pieces.size(); i++)
+            order[i] = std::make_pair(owners[i], i);
+        std::sort(order.begin(), order.end());
+        std::vector<bool> failed(coverage_ids.size(), false);
+        for (size_t i = 0, j; i < order.size(); i = j) {
+            size_t owner = order[i].first;
+            OGRPolyList feature_pieces;
+            std::vector<int> feature_depths;
+            for (j = i; j < order.size() && order[j].first == owner; j++) {
+                feature_pieces.push_back(pieces[order[j].second]);
+                feature_depths.push_back(depths[order[j].second]);
+            }
+            std::vector<GIntBig> fids;
+            size_t pieces_kept = (adjacency ? adjacency->pieces.size() : 0);
+            if (write_pieces(destLayer, &feature_pieces, coverage_ids[owner], KIND_PIECE,
+                             &feature_depths, &features_written, adjacency, &fids))
+                continue;
+            unwrite_pieces(destLayer, coverage_ids[owner], fids, &features_written);
+            if (adjacency != NULL)
+                forget_pieces(adjacency, pieces_kept);
+            quarantine_feature(quarantine, coverage_ids[owner],
+                               "couldn't write a piece to the output", NULL);
+            features_failed++;
+            failed[owner] = true;
+        }
+
+        /* Leave the features that failed out of the index and the tiles
+         * too. Their rings and edges were kept in the same order as their
+         * IDs, so the owners line up. */
+        size_t kept = 0;
+        for (size_t i = 0; i < index_segments.size(); i++)
+            if (!failed[index_segments[i].owner])
+                index_segments[kept++] = index_segments[i];
+        index_segments.resize(kept);
+        kept = 0;
+        for (size_t i = 0; i < coverage.size(); i++) {
+            if (failed[coverage[i].feature]) continue;
+            coverage[kept].feature = coverage[i].feature;
+            coverage[kept++].rings.swap(coverage[i].rings);
+        }
+        coverage.resize(kept);
+    }
+
+    /* Make the vector tiles, now that we have every feature. */
+    if (tiles_name != NULL) {
+        coverage_t *tiled = (mode == SPLIT_COVERAGE ? &coverage : &tile_parts);
+        OGREnvelope extent = (mode == SPLIT_COVERAGE ? coverage_extent : tile_extent);
+        if (tiled->empty()) {
+            extent.MinX = -180;
+            extent.MaxX = 180;
+            extent.MinY = -85;
+            extent.MaxY = 85;
+        }
+        size_t tiles = 0;
+        if (!write_tiles(tiles_name, tiled, extent, threads > 1 ? threads : 0,
+                         options, &tiles)) {
+            std::cerr << "Writing vector tiles to " << tiles_name << " failed.\n";
+            exit( 1 );
+        }
+        if (debug)
+            std::cerr << "Wrote " << tiles << " vector tiles.\n";
     }
 
-    /* Close the input and output data sources. */
+    /* Close the input and output data sources, and the quarantine. */
     OGRDataSource::DestroyDataSource( source );
     OGRDataSource::DestroyDataSource( dest );
+    if (transform != NULL) OGRCoordinateTransformation::DestroyCT( transform );
+    if (target_srs != NULL) target_srs->Release();
+    if (quarantine != NULL && fclose(quarantine) != 0) {
+        std::cerr << "Writing quarantine file " << quarantine_name << " failed.\n";
+        exit( 1 );
+    }
+
+    /* Build the location index over the whole layer, now that we have it. */
+    if (index_name != NULL) {
+        location_index_t index;
+        if (!build_location_index(index_segments, index_ids, precision, &index)) {
+            std::cerr << "The layer has too many features or edges for a location "
+                      << "index, which numbers them in 32 bits.\n";
+            exit( 1 );
+        }
+        if (precision > 0 && index.precision == 0)
+            std::cerr << "WARNING: the layer is too big to quantise to a precision of "
+                      << precision << ", so the location index keeps doubles.\n";
+        if (!write_location_index(index_name, index, codec)) {
+            std::cerr << "Writing location index " << index_name << " failed.\n";
+            exit( 1 );
+        }
+        if (debug)
+            std::cerr << "Location index has " << index_edge_count(index) << " edges in "
+                      << index.stops.size() - 1 << " slabs.\n";
+    }
+
+    /* Find which pieces are adjacent, now that they've all been written. */
+    if (adjacency != NULL) {
+        size_t pairs = 0;
+        if (!write_adjacency(adjacency_name, *adjacency, &pairs)) {
+            std::cerr << "Writing adjacency table " << adjacency_name << " failed.\n";
+            exit( 1 );
+        }
+        if (debug)
+            std::cerr << "Found " << pairs << " pairs of adjacent pieces, among "
+                      << adjacency->pieces.size() << " pieces.\n";
+    }
 
     std::cerr << features_read << " features read, " 
               << features_written << " written.\n";
+    if (features_failed > 0)
+        std::cerr << features_failed << " features failed"
+                  << (quarantine_name ? " and were quarantined" : "") << ".\n";
+    if (over_budget > 0)
+        std::cerr << over_budget << " features went over the time or step limit.\n";
+    if (debug && clipped[CLIP_GEOS] + clipped[CLIP_RECT] > 0)
+        std::cerr << "Cut " << clipped[CLIP_RECT] << " polygons with the rectangle clipper in "
+                  << clip_seconds[CLIP_RECT] << " s, and " << clipped[CLIP_GEOS]
+                  << " with GEOS in " << clip_seconds[CLIP_GEOS] << " s.\n";
+    if (debug && features_spilled > 0)
+        std::cerr << features_spilled << " features were split out of core.\n";
+    if (debug && memory_budget > 0)
+        std::cerr << "Held " << pool.held_back()
+                  << " features back to stay within the memory budget.\n";
+
+    /* Say what --verify found, and fail if it found anything. */
+    if (verify) {
+        std::set<feature_id_t> failed;
+        for (size_t i = 0; i < problems.size(); i++)
+            failed.insert(problems[i].first);
+        std::cerr << features_verified << " features verified, "
+                  << failed.size() << " failed.\n";
+        for (size_t i = 0; i < problems.size(); i++)
+            std::cerr << "feature " << problems[i].first << ": "
+                      << problems[i].second << "\n";
+        if (!failed.empty()) return 1;
+    }
 }
@@ -0,0 +1,81 @@
+#!/bin/sh
+# Runs polysplit over the polygons in this directory with -verify, which
+# fails if any feature's pieces don't add up to its area or overlap, or its
+# inner approximations aren't inside it.
+
+cd "$(dirname "$0")"
+POLYSPLIT=../polysplit
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+failed=0
+
+check() {
+    name=$1; shift
+    if "$POLYSPLIT" -f GeoJSON -verify "$@" "$OUT/$name.geojson" >"$OUT/$name.log" 2>&1; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        cat "$OUT/$name.log"
+        failed=1
+    fi
+}
+
+pieces() {
+    # Check the pieces the named check wrote, given -attributes: that their
+    # areas add up to the total, and that none is wider than the width.
+    name=$1 total=$2 width=$3
+    if awk -v total="$total" -v width="$width" '
+        function field(f) {
+            if (!match($0, "\"" f "\": *[-+0-9.eE]+")) return 0
+            s = substr($0, RSTART, RLENGTH); sub(/^[^:]*: */, "", s); return s + 0
+        }
+        /"Feature"/ {
+            sum += field("area")
+            if (field("maxx") - field("minx") > width) wide++
+        }
+        END { exit !(sum > total * (1 - 1e-9) && sum < total * (1 + 1e-9) && !wide) }
+    ' "$OUT/$name.geojson"; then
+        echo "ok   $name pieces"
+    else
+        echo "FAIL $name pieces"
+        failed=1
+    fi
+}
+
+lookup() {
+    # Look the points up in the location index the named check wrote with
+    # -l, and check that the answers are the expected ones, a line each.
+    name=$1 points=$2 expected=$3
+    if answers=$(printf "$points" | "$POLYSPLIT" -q "$OUT/$name.psli" 2>&1) \
+            && [ "$answers" = "$(printf "$expected")" ]; then
+        echo "ok   $name lookups"
+    else
+        echo "FAIL $name lookups"
+        echo "$answers"
+        failed=1
+    fi
+}
+
+# Two holes at the same height, where the bridge from one used to cross
+# the other.
+check two_holes_triangles -t two_holes.geojson
+check two_holes_convex -c two_holes.geojson
+
+# -verify also checks that inner approximations are inside their polygon,
+# which the largest convex piece of a polygon with holes used not to be.
+check two_holes_approximations -a 6 two_holes.geojson
+check two_holes_convex_approximations -c -a 6 two_holes.geojson
+
+# A location index made from a polygon with holes finds a point inside
+# the polygon, and nothing for one inside a hole.
+check two_holes_index -n id -l "$OUT/two_holes_index.psli" two_holes.geojson
+lookup two_holes_index '2 2\n8 8\n' '\n1'
+
+# A band right around the world doesn't cross the antimeridian, and has to
+# come out whole, but a polygon over the Pacific does, and gets cut there.
+check world_band -attributes world_band.geojson
+pieces world_band 3600 360
+check pacific -attributes pacific.geojson
+pieces pacific 400 10
+
+exit $failed